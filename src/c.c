@@ -6,8 +6,9 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
-#include <signal.h>
+#include <poll.h>
 #include <time.h>
 #include <ncurses.h>
 #include <panel.h>
@@ -18,12 +19,18 @@
 #include <ctype.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <locale.h>
 #include <limits.h>
 #include <regex.h>
+#include <pthread.h>
 
 #include "def.h"
 #include "drw.h"
+#include "filter.h"
+#include "rng.h"
+#include "stream.h"
+#include "hist.h"
 #include "utils.h"
 #include "loaders.h"
 #include "confsetters.h"
@@ -32,7 +39,7 @@
 enum { ARG_UNSET, ARG_OFF, ARG_ON };
 
 #define VERSION_STR PACKAGE_NAME" "PACKAGE_VERSION
-#define PTYPE_OPTIONS "[-vhcQw1]"
+#define PTYPE_OPTIONS "[-vhcQw1] [-s|--seed seed] [-m count | -r|--reservoir count]"
 #define USAGE_STR "Usage: "PACKAGE_NAME" "PTYPE_OPTIONS
 #define HELP_STR                                                       \
 	USAGE_STR                                                          \
@@ -45,17 +52,75 @@ enum { ARG_UNSET, ARG_OFF, ARG_ON };
 	"    -w              Omit warnings from being printed.\n"          \
 	"                    and set the starting mode to Quote.\n"        \
 	"    -1              Automatically quit after one test.\n"         \
+	"    -s, --seed seed Seed the first test; later tests follow\n"    \
+	"                    from it.\n"                                   \
+	"    -m count        Start once count words of a piped\n"          \
+	"                    dictionary are read, reading the rest\n"     \
+	"                    in the background.\n"                         \
+	"    -r, --reservoir count\n"                                     \
+	"                    Keep a random sample of at most count\n"     \
+	"                    words or quotes from a pipe.\n"              \
 
 struct {
 	int color;
 	bool quote;
 	bool oneshot;
 	bool warnings;
+	bool seeded;
+	uint64_t seed;
+	bool streamed;
+	size_t min_words;
+	size_t reservoir; /* 0 if stdin isn't sampled. */
 } ptype_args = {
 	.color = 0,
 	.quote = false,
 	.oneshot = false,
 	.warnings = true,
+	.seeded = false,
+	.streamed = false,
+	.reservoir = 0,
+};
+
+/* The next test's text, generated on a worker thread while the current
+ * one is shown. Only the worker touches $tt while $running. */
+struct {
+	pthread_t thread;
+	bool running;   /* the worker has been started and not joined. */
+	TypeText tt;
+	int ret;        /* gen_text_seed()'s return value. */
+	int width;
+	uint64_t seed;
+} prefetch = {
+	.running = false,
+};
+
+#define SETTLE_MS       300 /* a selection settles after this long without a key. */
+#define LOAD_POLL_MS    100
+#define MAX_SPOOLED     MAX_NWORDS /* retired words a test's history record keeps. */
+#define SPOOL_SLOT      (MAX_WORD+1 + MAX_WORD+MAX_ERR+1) /* bytes a retired word & its match take. */
+#define MAX_GEN_WORDS   (1 << 22)  /* words read from an executable dictionary at most. */
+#define MAX_GEN_QUOTES  (64 << 20) /* bytes read from an executable quotes-file at most. */
+
+/* Dictionaries and quotes-files selected in the options screen are loaded
+ * on worker threads. A load superseded by a newer selection is cancelled
+ * and kept in $stale until its thread has finished, so it's never waited on. */
+struct {
+	LoadJob* dict;
+	LoadJob* quotes;
+	LoadJob** stale;
+	size_t nstale;
+	size_t cap_stale;
+	bool dict_loading;
+	bool quotes_loading;
+	int idict;      /* index into $dict_files of $loaded_dict. */
+	int iquote;     /* index into $quotes_files of $loaded_quotes. */
+	Stream* dict_stream;   /* $loaded_dict is taken from, if output by an executable. */
+	Stream* quotes_stream; /* likewise for $loaded_quotes. */
+} loads = {
+	.dict = NULL,
+	.quotes = NULL,
+	.stale = NULL,
+	.nstale = 0,
 };
 
 #define STDIN_NAME "stdin"
@@ -132,8 +197,10 @@ ColorMap color_map           = {.colors = NULL, .sz = 0};
 Dictionary loaded_dict       = {.words  = NULL, .sz = 0};
 Dictionary stdin_dict        = {.words  = NULL, .sz = 0}; 
 Dictionary filtered_dict     = {.words  = NULL, .sz = 0};
+AliasTable filtered_alias    = {.prob   = NULL, .sz = 0};
 Quotes loaded_quotes         = {.quotes = NULL, .sz = 0};
 Quotes stdin_quotes          = {.quotes = NULL, .sz = 0};
+Stream* stdin_stream         = NULL; /* $stdin_dict is taken from, with -m. */
 Quotes filtered_quotes       = {.quotes = NULL, .sz = 0};
 bool colors_started          = false;
 int default_color            = 0;
@@ -142,14 +209,20 @@ Screen* screens              = NULL;
 char* user_config_dir        = NULL;
 char* user_state_dir         = NULL;
 char* user_hist_dir          = NULL;
+char* user_cache_dir         = NULL;
 char** quotes_files		     = NULL;
 char** dict_files		     = NULL;
+extern char** environ;
 char* path_quotes[PATHS_MAX] = {NULL};
 char* path_dicts[PATHS_MAX]  = {NULL};
 char** log_messages          = NULL;
 size_t sz_log			     = 0;
 bool filtered_dict_valid     = false;
+bool filtered_dict_owned     = false;
 bool filtered_quotes_valid   = false;
+bool punct_table_valid       = false;
+PunctTable punct_table       = {.entries = NULL, .sz = 0};
+uint64_t next_seed           = 0;
 char* mode_strs[] = {
 	[M_NORMAL] = "Normal",
 	[M_TIMED]  = "Timed",
@@ -176,7 +249,7 @@ int add_to_history(const TypeText* tt, const Stat* st);
 double avg_word_len(const TypeText*);
 ScreenNum begin_test(void);
 void cleanup(void);
-int cmp_str_ascend(const void*, const void*);
+int cmp_days_descend(const void*, const void*);
 void cycle_mode(void);
 void driver_range(void);
 void driver_select(void);
@@ -188,18 +261,20 @@ void fix_bkgd(void);
 void free_text(TypeText*);
 void free_quote(Quote*);
 void free_quotes(Quotes*);
-void free_hist(History*);
-int gen_digit_str(char*, int, int);
+void free_load(LoadJob*);
+int gen_digit_str(Rng*, char*, int, int);
+char** gen_env(void);
 int gen_from_dict(TypeText*, bool);
 int gen_from_quotes(TypeText*);
-int gen_insertion(char*);
+int gen_insertion(Rng*, char*);
 int gen_timed(TypeText*, int width);
-int gen_word(char*, bool);
+int gen_word(Rng*, char*, bool);
 int gen_text(TypeText*, int);
-int get_dict(const char*, Dictionary*);
+int gen_text_seed(TypeText*, int, uint64_t);
+int get_dict(const char*, char**, Dictionary*, Stream**, const atomic_bool*);
+int get_dict_cache_path(char*, size_t, const char*);
 void get_stats(const TypeText*, Stat*, long);
-int get_time_str(char*, size_t);
-int get_quotes(const char*, Quotes*);
+int get_quotes(const char*, char**, Quotes*, Stream**, const atomic_bool*);
 char* get_user_config_dir(void);
 char* get_user_state_dir(void);
 void init(void);
@@ -212,10 +287,13 @@ int init_stdin_dict(void);
 int init_stdin_quote(void);
 void init_stat(Stat*);
 void init_text(TypeText*);
-bool is_filtered_word(const char*);
+bool is_filtered_word(const Word*);
 bool is_filtered_quote(const Quote*);
+void load_cancel(LoadJob*);
+LoadJob* load_start(const char*, int, bool);
 ScreenNum loop_hist(void);
 void loop_hist_stat(void);
+void loop_hist_trends(void);
 ScreenNum loop_main(void);
 ScreenNum loop_start(void);
 ScreenNum loop_test(void);
@@ -236,27 +314,38 @@ void opt_last(void);
 void opt_next(void);
 void opt_prev(void);
 void opt_select(void);
+bool poll_loads(bool);
+void prefetch_cancel(void);
+void prefetch_hist(void);
+void prefetch_start(int);
+void prefetch_take(TypeText*, int);
 void print_log(void);
-void pull_word_next(TypeText*, size_t);
-void push_word_next(TypeText*, size_t);
-int punctuate(char*);
+int punctuate(Rng*, char*, int);
+void regen_punct_table(void);
 void regen_filtered_dict(void);
 void regen_filtered_quotes(void);
 int reset_attrs(void);
 void revert_rgb_colors(void);
+void* run_load(void*);
+void* run_prefetch(void*);
+int save_dict_cache(const char*, const Dictionary*, const struct stat*);
 ScreenNum screen_hist(void);
 ScreenNum screen_main(void);
 ScreenNum screen_stat(void);
 ScreenNum screen_start(void);
 ScreenNum screen_opt(void);
-void sig_nothing(int);
+void set_loaded_dict(Dictionary, int, Stream*);
+void set_loaded_quotes(Quotes, int, Stream*);
+void sync_streams(void);
 int tt_addch(WINDOW*, TypeText*, int);
+void tt_damage(TypeText*, int, int);
 void tt_delch(WINDOW*, TypeText*);
 void tt_fix_line(TypeText*, int, int);
 void tt_fix_all_lines(TypeText*, int);
 void tt_init_word(TypeText*, const char*, size_t);
+int tt_retire_lines(TypeText*);
 int update_config(const ConfigList*);
-int write_hist(FILE*, const TypeText*, const Stat*);
+int write_hist(FILE*, const TypeText*, const Stat*, const Dictionary*);
 double wpm(size_t, long);
 
 /******************/
@@ -286,30 +375,49 @@ int add_color_map_entry(char* color) {
 }
 
 int add_to_history(const TypeText* tt, const Stat* st) {
+	/* a dictionary from stdin or an executable differs from run to run,
+	 * so words from it are stored as they are. */
+	const Dictionary* const dict = (config.main != M_QUOTE && loaded_dict.sz
+		&& loaded_dict.words != stdin_dict.words && !loads.dict_stream)
+		? &loaded_dict : NULL;
+	HistEntry e = {.wpm = st->wpm, .acc = st->acc, .mode = config.main};
+	struct timespec now;
+	char* rec;
+	size_t len;
 	FILE* fd;
-	const size_t bsz = 1024;
-	const size_t tsz = 128;
-	char buf[bsz];
-	char time[tsz];
 
 	if(!user_hist_dir) return -1;
-	get_time_str(time, tsz);
-	snprintf(buf, bsz, "%s/%s", user_hist_dir, time);
-	if(!(fd = fopen(buf, "w"))) return -1;
-	write_hist(fd, tt, st);
-	fclose(fd);
+	if(config.hist_limit == 0) return 0;
+	if(!(fd = open_memstream(&rec, &len))) return -1;
+	if(write_hist(fd, tt, st, dict) < 0) {
+		fclose(fd);
+		free(rec);
+		return -1;
+	}
+
+	if(fclose(fd) == EOF) {
+		free(rec);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	e.time = (int64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+
+	/* the record is written in the background; failures show up on the
+	 * next test. */
+	if(hist_queue(rec, len, &e, dict, config.hist_limit) < 0 || hist_failed() > 0)
+		return -1;
+
 	return 0;
 }
 
 double avg_word_len(const TypeText* tt) {
-	if(tt->curr_word == 0)
-		return 0;
+	const int nwords = tt->nretired + tt->curr_word;
 
-	size_t sum = 0;
-	for(int i=0; i<tt->curr_word; ++i)
-		sum += tt->text[i].len;
+	if(nwords == 0)
+		return 0;
 
-	return (float)sum / tt->curr_word;
+	return (float)tt->sum_wlen / nwords;
 }
 
 ScreenNum begin_test(void) {
@@ -342,22 +450,35 @@ ScreenNum begin_test(void) {
 }
 
 void cleanup(void) {
+	prefetch_cancel();
+	/* loads still running are abandoned. */
+	if(loads.dict) load_cancel(loads.dict);
+	if(loads.quotes) load_cancel(loads.quotes);
+	loads.dict = loads.quotes = NULL;
+	poll_loads(false);
+	hist_close();
+	/* stops the executables still being read from. */
+	if(loads.dict_stream) stream_close(loads.dict_stream);
+	if(loads.quotes_stream) stream_close(loads.quotes_stream);
 	if(!isendwin()) endwin();
 }
 
-int cmp_str_descend(const void* a, const void* b) {
-	const char* const* a1 = a;
-	const char* const* b1 = b;
-	return strcmp(*b1, *a1);
+int cmp_days_descend(const void* a, const void* b) {
+	const HistDay* const d1 = a;
+	const HistDay* const d2 = b;
+	return (d1->day < d2->day) - (d1->day > d2->day);
 }
 
 void cycle_mode(void) {
 	MainScrData* const mdata = screens[SCR_MAIN].data;
 	const int nudge = (config.border ? 1 : 0);
+	const int width = getmaxx(mdata->win_text)-nudge*2;
 
+	prefetch_cancel();
 	config.main = (config.main+1) % NUM_MODES;
 	if(mdata->tt.text) free_text(&mdata->tt);
-	gen_text(&mdata->tt, getmaxx(mdata->win_text)-nudge*2);
+	gen_text(&mdata->tt, width);
+	prefetch_start(width);
 }
 
 void driver_range(void) {
@@ -408,7 +529,7 @@ void driver_select_next(void) {
 	while(true) {
 	 	*opt->selected = (*opt->selected == 0) ? opt->len_list-1 : *opt->selected-1;
 
-		if(opt->func) {
+		if(opt->func && !opt->loading) {
 			if(*opt->selected == save || opt->func() == 0)
 				return;
         }
@@ -424,7 +545,7 @@ void driver_select_prev(void) {
 	int save = *opt->selected;
 	while(true) {
 		*opt->selected = (*opt->selected+1) % opt->len_list;
-		if(opt->func) {
+		if(opt->func && !opt->loading) {
 			if(*opt->selected == save || opt->func() == 0)
 				return; 
 		}
@@ -436,25 +557,39 @@ void driver_select_prev(void) {
 void driver_select(void) {
 	OptScrData* const data = screens[SCR_OPT].data;
 	OptSelect* const opt = &data->options[data->opt_idx].select;
+	bool settled = true, busy = poll_loads(false);
 	int c;
 
 	if(opt->len_list <= 1) return;
 	redraw_opt();
-	while((c = wgetch(data->win_opt)) != ERR) {
+	while(true) {
+		wtimeout(data->win_opt, !settled ? SETTLE_MS : busy ? LOAD_POLL_MS : -1);
+		c = wgetch(data->win_opt);
+		wtimeout(data->win_opt, -1);
+
 		switch(c) {
 			case ESC: case ' ':
+				if(!settled) opt->func();
 				return;
 			case KEY_DOWN: case 'j':
 				driver_select_prev();
+				settled = !opt->loading;
 				break;
 			case KEY_UP: case 'k':
 				driver_select_next();
+				settled = !opt->loading;
 				break;
 			case KEY_RESIZE:
 				fix_bkgd();
 				break;
+			case ERR:
+				if(settled && !busy) return;
+				if(!settled) opt->func();
+				settled = true;
+				break;
 		}
 
+		busy = poll_loads(false);
 		redraw_opt();
 	}
 }
@@ -561,10 +696,15 @@ void fix_bkgd(void) {
 
 /* free a previously initialized TypeText structure and its members */
 void free_text(TypeText* tt) {
-	free_words(tt->text, tt->nwords);
-	free_words(tt->matches, tt->nwords);
+	Arena arena = tt->arena;
+	Arena arena_spare = tt->arena_spare;
+
+	arena_reset(&arena); /* the words are kept in $tt->arena. */
 	free(tt->lines);
+	if(tt->spool) fclose(tt->spool);
 	memset(tt, 0, sizeof(TypeText)); /* set pointers to NULL. */
+	tt->arena = arena;
+	tt->arena_spare = arena_spare;
 }
 
 void free_puncts(Punctuation* punct, size_t sz) {
@@ -572,11 +712,56 @@ void free_puncts(Punctuation* punct, size_t sz) {
 		free(punct[i].str);
 }
 
-void free_hist(History* hist) {
-	free_words(hist->text, hist->nwords);
-	free_words(hist->matches, hist->nmatches);
-	free_namevals(hist->stats, hist->sz_stats);
-	free(hist->stats);
+/* Wait for $job's thread, then free it and whatever it loaded. */
+void free_load(LoadJob* job) {
+	if(job->threaded) pthread_join(job->thread, NULL);
+	if(job->ret == 0 && job->is_quotes) free_quotes(&job->quotes);
+	else if(job->ret == 0) free_dict(&job->dict);
+	if(job->stream) stream_close(job->stream);
+	if(job->env) free_strs(job->env, strstr_len(job->env));
+	free(job->env);
+	free(job);
+}
+
+/* Return a copy of the environment with the options text is generated
+ * with added as PTYPE_<OPTION>, for running executable dictionaries and
+ * quotes-files; NULL on failure. */
+char** gen_env(void) {
+	const ConfRange* const wl = &config.word_length;
+	const ConfRange* const ql = &config.quote_length;
+	const size_t len = strstr_len(environ);
+	char buf[MAX_STRING_OPT+32];
+	char** env;
+	int ret = 0;
+
+	if(!(env = calloc(len+1, sizeof(char*))))
+		return NULL;
+
+	for(size_t i=0; i<len && ret == 0; i++)
+		if(!(env[i] = strdup(environ[i]))) ret = -1;
+
+	snprintf(buf, sizeof(buf), "PTYPE_MODE=%s", mode_strs[config.main]);
+	ret |= strstr_add(&env, buf);
+	snprintf(buf, sizeof(buf), "PTYPE_WORDS=%d", config.nwords);
+	ret |= strstr_add(&env, buf);
+	snprintf(buf, sizeof(buf), "PTYPE_TIMER=%d", config.timer);
+	ret |= strstr_add(&env, buf);
+	snprintf(buf, sizeof(buf), "PTYPE_PUNCTUATION=%d", config.punctuation);
+	ret |= strstr_add(&env, buf);
+	snprintf(buf, sizeof(buf), "PTYPE_WORD_LENGTH=%s", (wl->valid) ? wl->str : "");
+	ret |= strstr_add(&env, buf);
+	snprintf(buf, sizeof(buf), "PTYPE_QUOTE_LENGTH=%s", (ql->valid) ? ql->str : "");
+	ret |= strstr_add(&env, buf);
+	snprintf(buf, sizeof(buf), "PTYPE_WORD_FILTER=%s", (config.wfilter.valid) ? config.wfilter.str : "");
+	ret |= strstr_add(&env, buf);
+
+	if(ret < 0) {
+		free_strs(env, strstr_len(env));
+		free(env);
+		return NULL;
+	}
+
+	return env;
 }
 
 /* $tt should be freed and set to NULL before calling this function
@@ -593,20 +778,27 @@ int gen_from_dict(TypeText* tt, bool append) {
 
 	if(!append || !tt->text) {
 		tt->nwords = (append) ? initial_timed : config.nwords;
-		tt->text = ecalloc(tt->nwords, sizeof(Word));
-		tt->matches = ecalloc(tt->nwords, sizeof(Word));
+		tt->text = arena_alloc(&tt->arena, tt->nwords, sizeof(Word));
+		tt->matches = arena_alloc(&tt->arena, tt->nwords, sizeof(Word));
 	}
 
+	/* the old arrays stay in the arena until the test is freed. */
 	else if(append) {
-		tt->text = ereallocarray(tt->text, tt->nwords*=2, sizeof(Word));
-		tt->matches = ereallocarray(tt->matches, tt->nwords, sizeof(Word));
+		Word* text = arena_alloc(&tt->arena, tt->nwords*2, sizeof(Word));
+		Word* matches = arena_alloc(&tt->arena, tt->nwords*2, sizeof(Word));
+
+		memcpy(text, tt->text, tt->nwords * sizeof(Word));
+		memcpy(matches, tt->matches, tt->nwords * sizeof(Word));
+		tt->text = text;
+		tt->matches = matches;
+		tt->nwords *= 2;
 	}
 
 	for(int i=start; i<tt->nwords; i++) {
 		bool capitalize = config.punctuation && i>0 
 			&& strchr("?.!", tt->text[i-1].str[tt->text[i-1].len-1]);
 
-		if(gen_word(buf, capitalize) < 0) {
+		if(gen_word(&tt->rng, buf, capitalize) < 0) {
 			free_text(tt);
 			return -1;
 		}
@@ -627,12 +819,20 @@ int gen_from_quotes(TypeText* tt) {
 	if(filtered_quotes.sz == 0)
 		return -1;
 	
-	const Quote* const quote = &filtered_quotes.quotes[rand() % filtered_quotes.sz];
+	const Quote* const quote = &filtered_quotes.quotes[rng_below(&tt->rng, filtered_quotes.sz)];
+	Word* text;
+	char* blob;
+
+	if(load_quote_text(&loaded_quotes, quote, &text, &blob) < 0)
+		return -1;
 
-	tt->text = ecalloc(quote->sz, sizeof(Word));
-	tt->matches = ecalloc(quote->sz, sizeof(Word));
+	tt->text = arena_alloc(&tt->arena, quote->sz, sizeof(Word));
+	tt->matches = arena_alloc(&tt->arena, quote->sz, sizeof(Word));
 	for(size_t i=0; i<quote->sz; i++)
-		tt_init_word(tt, quote->text[i].str, i);
+		tt_init_word(tt, text[i].str, i);
+
+	free(text);
+	free(blob);
 
 	tt->nwords = quote->sz;
 	tt->author = quote->author;
@@ -641,59 +841,63 @@ int gen_from_quotes(TypeText* tt) {
 	return 0;
 }
 
-int gen_insertion(char* buf) {
+/* Return the length of the insertion written to $buf. */
+int gen_insertion(Rng* rng, char* buf) {
 	ConfRange* const dr = &config.digit_strs;
 
-	if(is_range_off(dr) || gen_digit_str(buf, dr->min, dr->max) < 0)
+	if(is_range_off(dr))
 		return -1;
 
-	return 0;
+	return gen_digit_str(rng, buf, dr->min, dr->max);
 }
 
 /* Used to initialize text for timed mode and generate text dynamically
  * during the test whenever text stops filling the text window */
 int gen_timed(TypeText* tt, int width) {
+	tt_retire_lines(tt);
 	while(tt->nlines-tt->curr_line < config.main_height+1) {
-		const size_t start = tt->nwords;
-
 		if(gen_from_dict(tt, true) < 0)
 			return -1;
 
-		for(int i = start; i<tt->nwords; i++)
-			tt->lines[tt->nlines-1].len += tt->text[i].len + 1;
-		
 		tt_fix_line(tt, tt->nlines-1, width);
 	}
 
 	return 0;
 }
 
-/* $buf's size is assumed to be greater than max */
-int gen_digit_str(char* buf, int min, int max) {
+/* $buf's size is assumed to be greater than max.
+ * Return the length of the digit string. */
+int gen_digit_str(Rng* rng, char* buf, int min, int max) {
 	if(max < min || min < 0) return -1;
 
-	const int len = (rand() % (max+1 - min)) + min;
+	const int len = rng_below(rng, max+1 - min) + min;
 	for(int i=0; i<len; i++)
-		buf[i] = '0' + (rand() % 10);
+		buf[i] = '0' + rng_below(rng, 10);
 
 	buf[len] = 0;
-	return 0;
+	return len;
 }
 
 /* Randomly generate a word from the filtered dictionary
  * $buf should be at least of size MAX_WORD+1 */
-int gen_word(char* buf, bool force_capitalize) {		
+int gen_word(Rng* rng, char* buf, bool force_capitalize) {		
 	ConfRange* const dr = &config.digit_strs;
+	int len;
 
-	if((filtered_dict.sz == 0 || (rand() % 100) < config.insert_freq) && gen_insertion(buf) == 0);
+	if((filtered_dict.sz == 0 || (int)rng_below(rng, 100) < config.insert_freq)
+	&& (len = gen_insertion(rng, buf)) >= 0);
 	else {
 		if(filtered_dict.sz == 0) return -1;
-		strcpy(buf, filtered_dict.words[rand() % filtered_dict.sz].str);
+		const Word* const word = &filtered_dict.words[(filtered_alias.sz)
+			? alias_sample(&filtered_alias, rng) : rng_below(rng, filtered_dict.sz)];
+
+		memcpy(buf, word->str, word->len+1);
+		len = word->len;
 		if(force_capitalize) buf[0] = toupper(buf[0]);
 	}
 
-	if((rand() % 100) < config.punctuation)
-		punctuate(buf);
+	if((int)rng_below(rng, 100) < config.punctuation)
+		punctuate(rng, buf, len);
 
 	return 0;
 }
@@ -703,8 +907,23 @@ int gen_word(char* buf, bool force_capitalize) {
  * for $tt should be freed before calling this function. 
  * On failure $tt is zero'd. */
 int gen_text(TypeText* tt, int width) {
+	const uint64_t seed = next_seed;
+
+	sync_streams();
+
+	/* each test's seed is derived from the last, so a run started
+	 * with -s replays every test in it. */
+	next_seed = splitmix64(&next_seed);
+	return gen_text_seed(tt, width, seed);
+}
+
+/* Generate the text of a test from $seed, without touching $next_seed. */
+int gen_text_seed(TypeText* tt, int width, uint64_t seed) {
     init_text(tt);
 
+	tt->seed = seed;
+	rng_seed(&tt->rng, tt->seed);
+
 	switch(config.main) {
 	case M_TIMED: return gen_timed(tt, width);
 	case M_NORMAL:
@@ -716,10 +935,6 @@ int gen_text(TypeText* tt, int width) {
 		if(gen_from_quotes(tt) < 0)
 			return -1;
 	}
-	
-	/* all words pushed on to the first line. */
-	for(int i=0; i<tt->nwords; i++)
-		tt->lines[0].len += tt->text[i].len + 1;
 
 	tt_fix_line(tt, 0, width);
 	return 0;
@@ -728,7 +943,7 @@ int gen_text(TypeText* tt, int width) {
 void get_stats(const TypeText* tt, Stat* st, long elapsed_ms) {
     st->elapsed_ms = elapsed_ms;
     num_chars_typed(tt, &st->ntyped, &st->ncorrect);
-    st->wtyped = tt->curr_word;
+    st->wtyped = tt->nretired + tt->curr_word;
     st->wpm = wpm(st->ncorrect, st->elapsed_ms);
     st->acc = accuracy(st->raw_typed, st->raw_correct);
     st->awl = avg_word_len(tt);
@@ -736,17 +951,6 @@ void get_stats(const TypeText* tt, Stat* st, long elapsed_ms) {
     st->source = tt->source;
 }
 
-int get_time_str(char* buf, size_t sz) {
-	const size_t bsz = 128;
-	char bbuf[bsz];
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-	struct tm* t = localtime(&tv.tv_sec); 
-	strftime(bbuf, bsz, "%Y-%m-%d-%H:%M:%S", t);
-	return snprintf(buf, sz, "%s,%03lu", bbuf, tv.tv_usec/1000);
-}
-
 char* get_user_config_dir(void) {
 	const size_t bsz = 2048;
 	char buf[bsz];
@@ -772,7 +976,7 @@ char* get_user_state_dir(void) {
 	char* var;
 
 	if((var = getenv("XDG_STATE_HOME"))) {
-		sprintf(buf, "%s/"DIR_STATE"/"DIR_HISTORY, var);
+		sprintf(buf, "%s/"DIR_STATE, var);
 		return strdup(buf);
 	}
 
@@ -791,10 +995,12 @@ void init(void) {
 	char** config_errors;
 	char* user_dicts_dir = NULL, *user_quotes_dir = NULL;
 	char* path_config[PATHS_MAX];
+	char** env;
 	int pd_len=0, pq_len=0, pc_len=0;
 	ConfigList conflist;
 
-	srand(time(NULL));
+	next_seed = (ptype_args.seeded) ? ptype_args.seed
+		: (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
 	setlocale(LC_ALL, "");
 	atexit(print_log);
 
@@ -822,6 +1028,9 @@ void init(void) {
 		user_hist_dir = ecalloc(strlen(user_state_dir) + strlen(DIR_HISTORY) + 2,
 			                    sizeof(char));
 		sprintf(user_hist_dir, "%s/%s", user_state_dir,  DIR_HISTORY);
+		user_cache_dir = ecalloc(strlen(user_state_dir) + strlen(DIR_DICT_CACHE) + 2,
+			                     sizeof(char));
+		sprintf(user_cache_dir, "%s/%s", user_state_dir, DIR_DICT_CACHE);
 	} else {
 		errlog("Warning: Failed to find user state directory!"
 			   " (ensure the $HOME or $XDG_STATE_HOME environment variable is set)");
@@ -830,7 +1039,7 @@ void init(void) {
 
 	if(dirs_contents(path_dicts, &dict_files, 0) < 0) {
 		errlog("Warning: Failed to read all dictionary directories");
-		dict_files = strstr_dup((char**){NULL});
+		dict_files = strstr_dup((char*[]){NULL});
 	}
 
 	strstr_remdup(dict_files);
@@ -842,7 +1051,7 @@ void init(void) {
 	free(user_dicts_dir);
 	if(dirs_contents(path_quotes, &quotes_files, 0) < 0) {
 		errlog("Warning: Failed to read all quotes directories");
-		quotes_files = strstr_dup((char**){NULL});
+		quotes_files = strstr_dup((char*[]){NULL});
 	}
 
 	if((result = find_str(quotes_files, STDIN_NAME)) != -1) {
@@ -852,9 +1061,18 @@ void init(void) {
 
 	strstr_remdup(quotes_files);
 	free(user_quotes_dir);
-	if(user_hist_dir)
-		if(create_dir(user_hist_dir, 0755) < 0)
-			if(errno != EEXIST) errlog("Warning: Failed to create history directory");
+	if(user_hist_dir) {
+		if(create_dir(user_hist_dir, 0755) < 0 && errno != EEXIST)
+			errlog("Warning: Failed to create history directory");
+		else if(hist_open(user_hist_dir) < 0)
+			errlog("Warning: Failed to open history");
+	}
+
+	if(user_cache_dir)
+		if(create_dir(user_cache_dir, 0755) < 0 && errno != EEXIST) {
+			free(user_cache_dir);
+			user_cache_dir = NULL;
+		}
 
 	if((config_file = path_fopen(path_config, FILE_CONFIG))) {
 		result = read_config(config_file, &conflist, &config_errors);
@@ -916,13 +1134,14 @@ void init(void) {
 		}
 	}
 
+	env = gen_env();
 	if(*dict_files) {
 		if(!streq(dict_files[config.idict], STDIN_NAME)) {
-			if(get_dict(dict_files[config.idict], &loaded_dict) != 0) {
+			if(get_dict(dict_files[config.idict], env, &loaded_dict, &loads.dict_stream, NULL) != 0) {
 				errlog("Warning: Failed to load selected dictionary!");
 				strstr_remove(dict_files, config.idict);
 				for(config.idict=0; dict_files[0];) {
-					if(get_dict(dict_files[0], &loaded_dict) == 0)
+					if(get_dict(dict_files[0], env, &loaded_dict, &loads.dict_stream, NULL) == 0)
 						break;
 
 					strstr_remove(dict_files, 0);
@@ -936,11 +1155,11 @@ void init(void) {
 
 	if(*quotes_files) {
 		if(!streq(quotes_files[config.iquote], STDIN_NAME)) {
-			if(get_quotes(quotes_files[config.iquote], &loaded_quotes) != 0) {
+			if(get_quotes(quotes_files[config.iquote], env, &loaded_quotes, &loads.quotes_stream, NULL) != 0) {
 				errlog("Warning: Failed to load selected quotes!");
 				strstr_remove(quotes_files, config.iquote);
 				for(config.iquote=0; quotes_files[0];) {
-					if(get_quotes(quotes_files[0], &loaded_quotes) == 0)
+					if(get_quotes(quotes_files[0], env, &loaded_quotes, &loads.quotes_stream, NULL) == 0)
 						break;
 
 					strstr_remove(quotes_files, 0);
@@ -952,6 +1171,14 @@ void init(void) {
 		} else loaded_quotes = stdin_quotes;
 	}
 
+	if(env) {
+		free_strs(env, strstr_len(env));
+		free(env);
+	}
+
+	loads.idict = config.idict;
+	loads.iquote = config.iquote;
+
 	initscr(); 
 	atexit(cleanup);
 	cbreak(); noecho(); nonl();
@@ -1058,10 +1285,10 @@ static inline void setopt(Option* opt, const char* label, OptType type, void* da
 
 static inline OptSelect setopt_select(
 		int* selected, char** list, 
-		size_t len_list, int(*func)(void)) {
+		size_t len_list, int(*func)(void), const bool* loading) {
 	return (OptSelect) {
 		.selected = selected, .list = list, 
-		.len_list = len_list, .func = func
+		.len_list = len_list, .func = func, .loading = loading
 	};
 }
 
@@ -1098,9 +1325,9 @@ int init_options(Option** options) {
 	size_t sz = 0;
 	Option* opt = ecalloc(128, sizeof(Option));
 
-	OptSelect mode   = setopt_select(&config.main,   mode_strs,    NUM_MODES,                NULL); 
-	OptSelect dict   = setopt_select(&config.idict,  dict_files,   strstr_len(dict_files),   optfunc_dict); 
-	OptSelect quotes = setopt_select(&config.iquote, quotes_files, strstr_len(quotes_files), optfunc_quotes); 
+	OptSelect mode   = setopt_select(&config.main,   mode_strs,    NUM_MODES,                NULL,           NULL); 
+	OptSelect dict   = setopt_select(&config.idict,  dict_files,   strstr_len(dict_files),   optfunc_dict,   &loads.dict_loading); 
+	OptSelect quotes = setopt_select(&config.iquote, quotes_files, strstr_len(quotes_files), optfunc_quotes, &loads.quotes_loading); 
 
 	OptRange lhist       = setopt_range(MIN_HIST_LIMIT,  MAX_HIST_LIMIT,  &config.hist_limit,  NULL);
 	OptRange words       = setopt_range(MIN_NWORDS,      MAX_NWORDS,      &config.nwords,      NULL);
@@ -1214,14 +1441,31 @@ int init_screens(void) {
 	return 0;
 }
 
+/* Read the dictionary piped to stdin, or with -m, start streaming it
+ * and take the words read so far; sync_streams() takes the rest.
+ * With -r only a sample of it is kept. */
 int init_stdin_dict(void) {
-	Dictionary dict;
+	Dictionary dict = {.words = NULL, .sz = 0};
+	Rng rng;
+
+	/* drawn apart from the tests' seeds, but replayed with -s all the same. */
+	rng_seed(&rng, ~next_seed);
+	if(ptype_args.streamed) {
+		if(!(stdin_stream = stream_dict_start(dup(STDIN_FILENO), -1, ptype_args.min_words, 0))
+		|| !stream_dict_update(stdin_stream, &dict))
+			return -1;
+	}
 
-	if(load_dictionary(stdin, &dict) < 0)
+	else if(ptype_args.reservoir) {
+		if(load_dictionary_sample(stdin, ptype_args.reservoir, &rng, &dict) < 0)
+			return -1;
+	}
+
+	else if(load_dictionary(stdin, &dict, NULL) < 0)
 		return -1;
 
 	if(strstr_add(&dict_files, STDIN_NAME) < 0) {
-		free_words(dict.words, dict.sz);
+		if(!ptype_args.streamed) free_dict(&dict);
 		return -1;
 	}
 
@@ -1231,8 +1475,15 @@ int init_stdin_dict(void) {
 
 int init_stdin_quote(void) {	
 	Quotes quotes;
+	Rng rng;
+
+	rng_seed(&rng, ~next_seed);
+	if(ptype_args.reservoir) {
+		if(load_quotes_sample(stdin, ptype_args.reservoir, &rng, &quotes) < 0)
+			return -1;
+	}
 
-	if(load_quotes(stdin, &quotes) < 0)
+	else if(load_quotes(stdin, &quotes, NULL) < 0)
 		return -1;
 
 	if(strstr_add(&quotes_files, STDIN_NAME) < 0) {
@@ -1251,12 +1502,18 @@ void init_text(TypeText* tt) {
 
 	tt->nwords         = 0;
 	tt->curr_word      = 0;
+	tt->nretired       = 0;
 	tt->curr_line      = 0;
+	tt->ntyped         = 0;
+	tt->ncorrect       = 0;
+	tt->sum_wlen       = 0;
 	tt->lines_cap      = initial_line_capacity;
 	tt->nlines         = 1;
 	tt->lines          = ecalloc(tt->lines_cap, sizeof(Line));
 	tt->lines[0].fword = 0;
 	tt->lines[0].len   = 0;
+	tt->dirty_first    = 0;
+	tt->dirty_last     = -1;
 	tt->text           = NULL;
 	tt->matches        = NULL;
     tt->author         = NULL;
@@ -1283,15 +1540,14 @@ ScreenNum loop_start(void) {
 }
 
 
-bool is_filtered_word(const char* word) {
+bool is_filtered_word(const Word* word) {
 	const ConfRange* const wl = &config.word_length;
 	ConfRegex* const re = &config.wfilter;
-	const int len = strlen(word);
 
-	if(!is_range_off(wl) && (len < wl->min || len > wl->max))
+	if(!is_range_off(wl) && (word->len < wl->min || word->len > wl->max))
 		return true;
 			
-	if(re->valid && regexec(&re->re, word, 0, NULL, 0) == REG_NOMATCH)
+	if(re->valid && regexec(&re->re, word->str, 0, NULL, 0) == REG_NOMATCH)
 		return true;
 
 	return false;
@@ -1307,6 +1563,35 @@ bool is_filtered_quote(const Quote* quote) {
 	return false;
 }
 
+/* Discard the result of $job once its thread finishes. If it hasn't
+ * started loading it won't, and a parse in progress is given up. */
+void load_cancel(LoadJob* job) {
+	atomic_store(&job->cancelled, true);
+	if(loads.nstale == loads.cap_stale) {
+		loads.cap_stale = (loads.cap_stale) ? loads.cap_stale*2 : 16;
+		loads.stale = ereallocarray(loads.stale, loads.cap_stale, sizeof(LoadJob*));
+	}
+
+	loads.stale[loads.nstale++] = job;
+}
+
+/* Start loading the dictionary or quotes-file $name, the $index'th
+ * of its list, on a worker thread, or here if none can be started. */
+LoadJob* load_start(const char* name, int index, bool is_quotes) {
+	LoadJob* const job = ecalloc(1, sizeof(LoadJob));
+
+	job->name = name;
+	job->index = index;
+	job->is_quotes = is_quotes;
+	job->env = gen_env();
+	atomic_init(&job->cancelled, false);
+	atomic_init(&job->done, false);
+	if(!(job->threaded = pthread_create(&job->thread, NULL, run_load, job) == 0))
+		run_load(job);
+
+	return job;
+}
+
 ScreenNum loop_hist(void) {
 	HistScrData* const data = screens[SCR_HIST].data;
 	
@@ -1330,11 +1615,16 @@ ScreenNum loop_hist(void) {
 			data->selected = data->nhist-1;
 			break;
 		case KEY_ENTER: case 'l': case ' ':
-			if(!data->hist_files) break;
+			if(data->failed || data->nhist == 0) break;
 			data->is_selected = true;
 			loop_hist_stat();
 			data->is_selected = false;
 			break;
+		case 't':
+			data->show_trends = true;
+			loop_hist_trends();
+			data->show_trends = false;
+			break;
 		case ESC: case 'h': return SCR_MAIN;
 		default:
 			if(keyname_cmp(key, "^J"))
@@ -1344,6 +1634,7 @@ ScreenNum loop_hist(void) {
 				data->selected = max(0, data->selected-5);
 		}
 		
+		prefetch_hist();
 		redraw_hist();
 	}
 
@@ -1352,13 +1643,8 @@ ScreenNum loop_hist(void) {
 
 void loop_hist_stat(void) {
 	HistScrData* const data = screens[SCR_HIST].data;
-	const size_t bsz = 1024;
-	char buf[bsz];
-	FILE* fd;
-			
-	const char* fname = data->hist_files[data->selected];
-	snprintf(buf, bsz, "%s/%s", user_hist_dir, fname);
-	if(!(fd = fopen(buf, "r"))) { 
+
+	if(hist_entry(data->selected, &data->entry) < 0) { 
 		data->errmsg = "Failed To Open File";
 		redraw_hist();
 		wgetch(data->win_hist);
@@ -1366,17 +1652,16 @@ void loop_hist_stat(void) {
 		return;
 	}
 
-	if(load_hist(fd, &data->hist) < 0) {
+	/* usually already parsed by prefetch_hist(). */
+	if(hist_fetch(&data->entry, HIST_WIN_WIDTH-(config.border ? 2 : 0),
+		&data->hist, &data->nlines) < 0) {
 		data->errmsg = "Failed To Parse File";
 		redraw_hist();
-		wgetch(data->win_hist); data->errmsg = NULL; fclose(fd);
+		wgetch(data->win_hist); data->errmsg = NULL;
 		return;
 	}
 
 	data->first_line = 0;
-	data->nlines = nlines_text(data->hist.text, data->hist.matches, 
-			data->hist.nwords, data->hist.nmatches,
-			HIST_WIN_WIDTH-(config.border ? 2 : 0));
 	redraw_hist();
 	while(true) {
 		int key = wgetch(data->win_hist);
@@ -1398,16 +1683,61 @@ void loop_hist_stat(void) {
 			data->first_line = data->nlines-1;
 			break;
 		case ESC: case 'h':
-			fclose(fd);
-			free_hist(&data->hist);
 			return;
 		}
 			
 		redraw_hist();
 	}
+}
+
+void loop_hist_trends(void) {
+	HistScrData* const data = screens[SCR_HIST].data;
+
+	if(hist_summary(&data->sum) < 0) {
+		data->errmsg = "Failed To Read Trends";
+		redraw_hist();
+		wgetch(data->win_hist);
+		data->errmsg = NULL;
+		return;
+	}
+
+	data->ndays = 0;
+	for(int i=0; i<HIST_DAYS; i++)
+		if(data->sum.days[i].ntests)
+			data->days[data->ndays++] = data->sum.days[i];
+
+	/* a slot that wasn't reused can hold a day older than the rest. */
+	qsort(data->days, data->ndays, sizeof(HistDay), cmp_days_descend);
+	while(data->ndays && data->days[data->ndays-1].day <= data->days[0].day - HIST_DAYS)
+		data->ndays--;
+
+	data->first_line = 0;
+	redraw_hist();
+	while(true) {
+		int key = wgetch(data->win_hist);
+		switch(key) {
+		case KEY_RESIZE:
+			fix_bkgd();
+			redraw_hist();
+			continue;
+		case KEY_DOWN: case 'j':
+			data->first_line = max(0, min(data->ndays-1, data->first_line+1));
+			break;
+		case KEY_UP: case 'k':
+			data->first_line = max(0, data->first_line-1);
+			break;
+		case 'g':
+			data->first_line = 0;
+			break;
+		case 'G':
+			data->first_line = max(0, data->ndays-1);
+			break;
+		case ESC: case 'h': case 't':
+			return;
+		}
 
-	fclose(fd);
-	free_hist(&data->hist);
+		redraw_hist();
+	}
 }
 
 /* input loop for the main screen. */
@@ -1443,7 +1773,8 @@ ScreenNum loop_main(void) {
         
 		else if(keyname_cmp(key, "^R")) {
         	free_text(&data->tt);
-        	gen_text(&data->tt, width_win);
+        	prefetch_take(&data->tt, width_win);
+        	prefetch_start(width_win);
         }
         
 		else if(isprint(key)) {
@@ -1463,51 +1794,46 @@ ScreenNum loop_main(void) {
 	return scrnum;
 }
 
-/* input loop for the type test screen. */
+/* input loop for the type test screen. Keys are read without blocking;
+ * when none are buffered the terminal is polled, waking up every $tick_ms
+ * in timed mode to redraw the countdown and to end the test exactly at the
+ * deadline. A SIGWINCH interrupts the poll and is then read as KEY_RESIZE. */
 ScreenNum loop_test(void) {
 	MainScrData* const mdata = screens[SCR_MAIN].data;
+	WINDOW* const win = mdata->win_text;
 	const int nudge = (config.border ? 1 : 0);
-	const int width = getmaxx(mdata->win_text)-nudge*2;
+	const int width = getmaxx(win)-nudge*2;
 	const bool timed = config.main == M_TIMED && config.timer; 
+	const long tick_ms = 100;
 
-	if(timed) {
-		sigset_t sigset;
-		struct sigaction sigact = {
-			.sa_handler = sig_nothing,
-			.sa_flags   = 0,
-		};
-
-		sigemptyset(&sigset);
-		sigact.sa_mask = sigset;
-		sigaction(SIGALRM, &sigact, NULL);
-	}
-
+	nodelay(win, true);
 	while(true) {
+		struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+		long left_ms = -1;
 		int key;
 
 		if(timed) { 
 			struct timespec now;
 
 			clock_gettime(CLOCK_MONOTONIC, &now);
-			if(elapsed_ms(&mdata->time_start, &now) > config.timer*1e3) 
+			left_ms = config.timer*1000L - elapsed_ms(&mdata->time_start, &now);
+			if(left_ms <= 0) 
 				break;
-
-			alarm(1);
 		}
 
-		if((key = wgetch(mdata->win_text)) == ERR) {
-			if(errno == EINTR) redraw_main();
+		if((key = wgetch(win)) == ERR) {
+			if(poll(&pfd, 1, (timed) ? min(left_ms, tick_ms) : -1) == 0)
+				update_main();
+
 			continue;
 		}
 
-		if(timed) alarm(0);
-		
 		if(isprint(key)) {
-			if(tt_addch(mdata->win_text, &mdata->tt, key) == 1) break;
+			if(tt_addch(win, &mdata->tt, key) == 1) break;
 		}
 
 		else if(key == KEY_BACKSPACE || keyname_cmp(key, "^?") || keyname_cmp(key, "^H"))
-			tt_delch(mdata->win_text, &mdata->tt);
+			tt_delch(win, &mdata->tt);
 
 		else if(key == ESC) break;
 
@@ -1518,22 +1844,31 @@ ScreenNum loop_test(void) {
 		if(config.main == M_TIMED)
 			gen_timed(&mdata->tt, width);
 
-        redraw_main();
+		/* only a resize needs the whole window repainted. */
+		if(key == KEY_RESIZE) redraw_main();
+		else update_main();
 	}
 	
-	if(timed) signal(SIGALRM, SIG_DFL);
-
+	nodelay(win, false);
 	return SCR_STAT;
 }
 
 ScreenNum loop_opt(void) {
 	OptScrData* const data = screens[SCR_OPT].data;
+	bool busy = poll_loads(false);
 
 	while(true) {
-		int key = wgetch(data->win_opt);
+		int key;
+
+		wtimeout(data->win_opt, busy ? LOAD_POLL_MS : -1);
+		key = wgetch(data->win_opt);
+		wtimeout(data->win_opt, -1);
 
 		switch(key) {
-			case ESC: return SCR_MAIN;
+			case ESC:
+				/* the next text must come from the selected files. */
+				poll_loads(true);
+				return SCR_MAIN;
 			case KEY_UP:   case 'k': opt_prev();  break;
 			case KEY_DOWN: case 'j': opt_next();  break;
 			case 'g':                opt_first(); break;
@@ -1547,6 +1882,7 @@ ScreenNum loop_opt(void) {
 				fix_bkgd();
 		}
 
+		busy = poll_loads(false);
         redraw_opt();
 	}
 
@@ -1554,24 +1890,9 @@ ScreenNum loop_opt(void) {
 }
 
 void num_chars_typed(const TypeText* tt, int* typed, int* correct) {
-    *typed = 0;
-    *correct = 0;
-
-    /* $tt->curr_word may be 1 greater than the last word in the case
-     * every word was typed. */
-    for(int i=0; i<=min(tt->curr_word, tt->nwords-1); i++) {
-        const Word* text = &tt->text[i];
-        const Word* match = &tt->matches[i];
-
-        *typed += match->len;
-        for(int j=0; j<text->len; j++)
-            if(text->str[j] == match->str[j])
-                *correct+=1;
-    }
-
     /* account for spaces. */
-    *typed += tt->curr_word;
-    *correct += tt->curr_word;
+    *typed = tt->ntyped + tt->nretired + tt->curr_word;
+    *correct = tt->ncorrect + tt->nretired + tt->curr_word;
 }
 
 int optfunc_circumfix(void) {
@@ -1584,28 +1905,32 @@ int optfunc_confpunct(ConfPunct* punct, int type) {
 		free(punct->punct);
 	}
 	
+	punct_table_valid = false;
 	return parse_punct(punct, type);
 }
 
+/* Start loading the selected dictionary; poll_loads() installs it. */
 int optfunc_dict(void) {
-	Dictionary dict;
-	int ret;
+	if(loads.dict) {
+		load_cancel(loads.dict);
+		loads.dict = NULL;
+		loads.dict_loading = false;
+	}
 
-	if(!streq(dict_files[config.idict], STDIN_NAME)) {
-		if((ret = get_dict(dict_files[config.idict], &dict)) != 0)
-			return -1;
-	} else dict = stdin_dict;
+	if(streq(dict_files[config.idict], STDIN_NAME)) {
+		set_loaded_dict(stdin_dict, config.idict, NULL);
+		return 0;
+	}
 
-	if(loaded_dict.words != stdin_dict.words)
-		free_words(loaded_dict.words, loaded_dict.sz);
+	if(config.idict == loads.idict)
+		return 0;
 
-	loaded_dict = dict;
-	filtered_dict_valid = false;
+	loads.dict = load_start(dict_files[config.idict], config.idict, false);
+	loads.dict_loading = true;
 	return 0;
 }
 
 int optfunc_digit_strs(void) {
-	filtered_dict_valid = false;
 	return optfunc_range(&config.digit_strs, 1, MAX_WORD);
 }
 
@@ -1635,19 +1960,24 @@ int optfunc_quote_length(void) {
 	return optfunc_range(&config.quote_length, 1, MAX_QUOTE_LENGTH);
 }
 
+/* Start loading the selected quotes-file; poll_loads() installs it. */
 int optfunc_quotes(void) {
-	Quotes q;
+	if(loads.quotes) {
+		load_cancel(loads.quotes);
+		loads.quotes = NULL;
+		loads.quotes_loading = false;
+	}
 
-	if(!streq(quotes_files[config.iquote], STDIN_NAME)) {
-		if(get_quotes(quotes_files[config.iquote], &q) < 0)
-			return -1;
-	} else q = stdin_quotes;
+	if(streq(quotes_files[config.iquote], STDIN_NAME)) {
+		set_loaded_quotes(stdin_quotes, config.iquote, NULL);
+		return 0;
+	}
 
-	if(loaded_quotes.quotes != stdin_quotes.quotes)
-		free_quotes(&loaded_quotes);
+	if(config.iquote == loads.iquote)
+		return 0;
 
-	loaded_quotes = q;
-	filtered_quotes_valid = false;
+	loads.quotes = load_start(quotes_files[config.iquote], config.iquote, true);
+	loads.quotes_loading = true;
 	return 0;
 }
 
@@ -1724,111 +2054,283 @@ void opt_select(void) {
 	
 }
 
-void print_log(void) {
-	for(size_t i=0; i<sz_log; i++) {
-		fprintf(stderr, "%s\n", log_messages[i]);
+/* Reap finished cancelled loads and install finished selected ones, first
+ * waiting for the selected ones if $wait; cancelled loads are never waited
+ * on. Return whether any are still running. A failed load reverts the
+ * selection to the file already loaded. */
+bool poll_loads(bool wait) {
+	for(size_t i=0; i<loads.nstale;) {
+		if(atomic_load(&loads.stale[i]->done)) {
+			free_load(loads.stale[i]);
+			loads.stale[i] = loads.stale[--loads.nstale];
+		} else i++;
+	}
+
+	if(loads.dict && (wait || atomic_load(&loads.dict->done))) {
+		LoadJob* const job = loads.dict;
+
+		if(job->threaded) pthread_join(job->thread, NULL);
+		job->threaded = false;
+		if(job->ret == 0) set_loaded_dict(job->dict, job->index, job->stream);
+		else if(config.idict == job->index) config.idict = loads.idict;
+
+		job->ret = -1;
+		job->stream = NULL;
+		free_load(job);
+		loads.dict = NULL;
+		loads.dict_loading = false;
+	}
+
+	if(loads.quotes && (wait || atomic_load(&loads.quotes->done))) {
+		LoadJob* const job = loads.quotes;
+
+		if(job->threaded) pthread_join(job->thread, NULL);
+		job->threaded = false;
+		if(job->ret == 0) set_loaded_quotes(job->quotes, job->index, job->stream);
+		else if(config.iquote == job->index) config.iquote = loads.iquote;
+
+		job->ret = -1;
+		job->stream = NULL;
+		free_load(job);
+		loads.quotes = NULL;
+		loads.quotes_loading = false;
 	}
+
+	return loads.dict || loads.quotes || loads.nstale;
 }
 
-/* Move the first word on the next line to $line */
-void pull_word_next(TypeText* tt, size_t line) {
-	const size_t vlen = word_visual_len(tt, tt->lines[line+1].fword++);
+/* Wait for the worker, if any, and discard what it generated. */
+void prefetch_cancel(void) {
+	if(prefetch.running) {
+		pthread_join(prefetch.thread, NULL);
+		prefetch.running = false;
+	}
 
-	tt->lines[line].len += vlen + 1;
-	tt->lines[line+1].len -= vlen + 1;
-    if(tt->curr_word == tt->lines[line+1].fword-1)
-        tt->curr_line--;
+	if(prefetch.tt.text) free_text(&prefetch.tt);
 }
 
-/* Move the last word on $line to the next line */
-void push_word_next(TypeText* tt, size_t line) {
-	const size_t vlen = word_visual_len(tt, --tt->lines[line+1].fword);
+/* Have the selected test's record and those either side of it parsed in
+ * the background, so opening one doesn't wait on the disk. */
+void prefetch_hist(void) {
+	HistScrData* const data = screens[SCR_HIST].data;
+	const int near[] = {data->selected, data->selected+1, data->selected-1};
+	HistEntry es[3];
+	size_t n = 0;
+
+	for(int i=0; i<3; i++)
+		if(near[i] >= 0 && near[i] < data->nhist && hist_entry(near[i], &es[n]) == 0)
+			n++;
 
-	tt->lines[line].len -= vlen + 1;
-	tt->lines[line+1].len += vlen + 1;
-    if(tt->curr_word == tt->lines[line+1].fword)
-        tt->curr_line++;
+	hist_prefetch(es, n, HIST_WIN_WIDTH-(config.border ? 2 : 0));
 }
 
-/* $buf is expected to be at least of size MAX_WORD+1 */
-int punctuate(char* buf) {
-	struct PunctRarity {
-		Punctuation punct;
-		int rarity;
-	};
+/* Start generating the text of the test after the next one's seed on a
+ * worker thread. The tables generation reads lazily are brought up to
+ * date here first, so the worker only ever reads shared state. */
+void prefetch_start(int width) {
+	if(prefetch.running) return;
+	if(prefetch.tt.text) free_text(&prefetch.tt);
 
-	int p;
-	/* setting $punct to NULL avoids an unecessary compiler warning */
-	const Punctuation* punct = NULL;
-	static const struct PunctRarity puncts[] = {
-		{ .punct = {.str = ",",    .type = PUNCT_POSTFIX},   .rarity = 20},
-		{ .punct = {.str = ".",    .type = PUNCT_POSTFIX},   .rarity = 40},
-		{ .punct = {.str = "!",    .type = PUNCT_POSTFIX},   .rarity = 50},
-		{ .punct = {.str = ";",    .type = PUNCT_POSTFIX},   .rarity = 60},
-		{ .punct = {.str = "?",    .type = PUNCT_POSTFIX},   .rarity = 70},
-		{ .punct = {.str = ":",    .type = PUNCT_POSTFIX},   .rarity = 80},
-		{ .punct = {.str = "...",  .type = PUNCT_POSTFIX},   .rarity = 85},
-		{ .punct = {.str = "()",   .type = PUNCT_CIRCUMFIX}, .rarity = 90},
-		{ .punct = {.str = "''",   .type = PUNCT_CIRCUMFIX}, .rarity = 95},
-		{ .punct = {.str = "\"\"", .type = PUNCT_CIRCUMFIX}, .rarity = 100},
-	};
+	sync_streams();
 
-	int pmax = 100;
-	if(config.postfix.valid && config.postfix.sz)
-		pmax += 10;
+	if(config.main == M_QUOTE && !filtered_quotes_valid) {
+		regen_filtered_quotes();
+		filtered_quotes_valid = true;
+	}
 
-	if(config.circumfix.valid && config.circumfix.sz) 
-		pmax +=  5;
+	if(config.main != M_QUOTE && !filtered_dict_valid) {
+		regen_filtered_dict();
+		filtered_dict_valid = true;
+	}
 
-	p = (rand() % (pmax+20))+1;
+	if(config.main != M_QUOTE && !punct_table_valid) {
+		regen_punct_table();
+		punct_table_valid = true;
+	}
 
-	/* only capitalize */
-	if(p > pmax) {
-		buf[0] = toupper(buf[0]);
-		return 0;
+	prefetch.width = width;
+	prefetch.seed = next_seed;
+	prefetch.running = pthread_create(&prefetch.thread, NULL, run_prefetch, NULL) == 0;
+}
+
+/* Move the prefetched text into the freed $tt, generating it here if
+ * nothing usable was prefetched. */
+void prefetch_take(TypeText* tt, int width) {
+	if(prefetch.running) {
+		pthread_join(prefetch.thread, NULL);
+		prefetch.running = false;
 	}
 
-	/* set $punct punctuation from $puncts */
-	if(p <= 100) {
-		for(size_t i=0; i < arr_size(puncts); i++)
-			if(p <= puncts[i].rarity) {
-				punct = &puncts[i].punct;
-				break;
-			}
+	if(!prefetch.tt.text || prefetch.ret < 0 || prefetch.seed != next_seed) {
+		prefetch_cancel();
+		gen_text(tt, width);
+		return;
 	}
 
-	/* set $punct from the extra user-configured punctuations */
-	else {
-		punct = (p <= 110 - (config.postfix.valid && config.postfix.sz ? 0 : 10))
-			? &config.postfix.punct[rand() % config.postfix.sz]
-			: &config.circumfix.punct[rand() % config.circumfix.sz];
+	/* $tt keeps the arenas of the swapped out text for the next one. */
+	const TypeText temp = *tt;
+	*tt = prefetch.tt;
+	prefetch.tt = temp;
+	next_seed = splitmix64(&next_seed);
+	if(width != prefetch.width)
+		tt_fix_all_lines(tt, width);
+}
+
+void print_log(void) {
+	for(size_t i=0; i<sz_log; i++) {
+		fprintf(stderr, "%s\n", log_messages[i]);
 	}
+}
 
-	switch(punct->type) {
-		case PUNCT_POSTFIX:
-			if(strlen(buf)+strlen(punct->str) > MAX_WORD)
-				return -1;
+/* Punctuate the word of length $len in $buf, which is expected to be at
+ * least of size MAX_WORD+1, or only capitalize it. */
+int punctuate(Rng* rng, char* buf, int len) {
+	size_t lo = 0, hi;
+	unsigned u;
+
+	if(!punct_table_valid) {
+		regen_punct_table();
+		punct_table_valid = true;
+	}
+
+	/* find the first entry whose cumulative weight exceeds $u. */
+	hi = punct_table.sz - 1;
+	u = rng_below(rng, punct_table.entries[hi].cum);
+	while(lo < hi) {
+		const size_t mid = lo + (hi-lo)/2;
 
-			strcat(buf, punct->str);
+		if(punct_table.entries[mid].cum > u) hi = mid;
+		else lo = mid+1;
+	}
+
+	const PunctEntry* const e = &punct_table.entries[lo];
+	const int half = e->len/2;
+
+	if(e->len == 0) {
+		buf[0] = toupper(buf[0]);
+		return 0;
+	}
+
+	if(len + e->len > MAX_WORD)
+		return -1;
+
+	switch(e->punct.type) {
+		case PUNCT_POSTFIX:
+			memcpy(buf+len, e->punct.str, e->len+1);
 			break;
 
 		case PUNCT_CIRCUMFIX:
-			if(strlen(buf)+strlen(punct->str) > MAX_WORD) return -1;
-			encase_word(buf, punct->str);
+			memmove(buf+half, buf, len);
+			memcpy(buf, e->punct.str, half);
+			memcpy(buf+half+len, e->punct.str+half, half);
+			buf[len+e->len] = '\0';
 			break;
 	}
 
 	return 0;
 }
 
+/* Merge the built-in punctuation, the extra configured punctuation
+ * and capitalizing alone into $punct_table. Of every 120 words
+ * punctuated, built-in punctuation gets 100, capitalization alone 20,
+ * and if configured extra postfixes 10 and extra circumfixes 5, split
+ * evenly between their entries. Weights are scaled by the number of
+ * extra entries so they stay integers. */
+void regen_punct_table(void) {
+	static const struct {
+		Punctuation punct;
+		unsigned weight;
+	} builtin[] = {
+		{ .punct = {.str = ",",    .type = PUNCT_POSTFIX},   .weight = 20},
+		{ .punct = {.str = ".",    .type = PUNCT_POSTFIX},   .weight = 20},
+		{ .punct = {.str = "!",    .type = PUNCT_POSTFIX},   .weight = 10},
+		{ .punct = {.str = ";",    .type = PUNCT_POSTFIX},   .weight = 10},
+		{ .punct = {.str = "?",    .type = PUNCT_POSTFIX},   .weight = 10},
+		{ .punct = {.str = ":",    .type = PUNCT_POSTFIX},   .weight = 10},
+		{ .punct = {.str = "...",  .type = PUNCT_POSTFIX},   .weight = 5},
+		{ .punct = {.str = "()",   .type = PUNCT_CIRCUMFIX}, .weight = 5},
+		{ .punct = {.str = "''",   .type = PUNCT_CIRCUMFIX}, .weight = 5},
+		{ .punct = {.str = "\"\"", .type = PUNCT_CIRCUMFIX}, .weight = 5},
+	};
+
+	const ConfPunct* const post = &config.postfix;
+	const ConfPunct* const circ = &config.circumfix;
+	const size_t npost = (post->valid) ? post->sz : 0;
+	const size_t ncirc = (circ->valid) ? circ->sz : 0;
+	const unsigned scale = (npost ? npost : 1) * (ncirc ? ncirc : 1);
+	PunctEntry* e;
+	unsigned cum = 0;
+
+	punct_table.sz = arr_size(builtin) + npost + ncirc + 1;
+	punct_table.entries = ereallocarray(punct_table.entries, punct_table.sz, sizeof(PunctEntry));
+	e = punct_table.entries;
+
+	for(size_t i=0; i<arr_size(builtin); i++, e++)
+		*e = (PunctEntry){builtin[i].punct, strlen(builtin[i].punct.str), cum += builtin[i].weight*scale};
+
+	for(size_t i=0; i<npost; i++, e++)
+		*e = (PunctEntry){post->punct[i], strlen(post->punct[i].str), cum += 10*scale/npost};
+
+	for(size_t i=0; i<ncirc; i++, e++)
+		*e = (PunctEntry){circ->punct[i], strlen(circ->punct[i].str), cum += 5*scale/ncirc};
+
+	/* capitalize only. */
+	*e = (PunctEntry){{.str = "", .type = PUNCT_POSTFIX}, 0, cum += 20*scale};
+}
+
+/* The word-length range is a slice of $loaded_dict, which is ordered by
+ * length; without a word filter $filtered_dict is simply that slice. */
 void regen_filtered_dict(void) {
-	free(filtered_dict.words);
+	const ConfRange* const wl = &config.word_length;
+	size_t lo = 0, hi = loaded_dict.sz;
+	const uint64_t* bits;
+
+	if(filtered_dict_owned) {
+		free(filtered_dict.words);
+		free(filtered_dict.counts);
+	}
+
+	if(!is_range_off(wl)) {
+		lo = loaded_dict.len_idx[min(max(wl->min, 0), MAX_WORD+1)];
+		hi = loaded_dict.len_idx[min(max(wl->max+1, 0), MAX_WORD+1)];
+		hi = (hi < lo) ? lo : hi;
+	}
+
+	if(!config.wfilter.valid) {
+		filtered_dict.words = loaded_dict.words + lo;
+		filtered_dict.counts = (loaded_dict.counts) ? loaded_dict.counts + lo : NULL;
+		filtered_dict.sz = hi - lo;
+		filtered_dict_owned = false;
+	}
+
+	else {
+		filtered_dict.words = ecalloc((hi > lo) ? hi - lo : 1, sizeof(Word));
+		filtered_dict.counts = (loaded_dict.counts)
+			? ecalloc((hi > lo) ? hi - lo : 1, sizeof(uint32_t)) : NULL;
+		filtered_dict.sz = 0;
+		filtered_dict_owned = true;
+
+		/* fall back to filtering serially if the parallel filter fails. */
+		bits = filter_words(&loaded_dict, lo, hi, config.wfilter.str);
+		for(size_t i=lo; i<hi; i++) {
+			if(bits ? !(bits[(i-lo)/64] & (UINT64_C(1) << ((i-lo)%64)))
+			        : is_filtered_word(&loaded_dict.words[i]))
+				continue;
+
+			if(filtered_dict.counts)
+				filtered_dict.counts[filtered_dict.sz] = loaded_dict.counts[i];
 
-	filtered_dict.words = ecalloc(loaded_dict.sz, sizeof(Word));
-	filtered_dict.sz = 0;
-	for(size_t i=0; i<loaded_dict.sz; i++)
-		if(!is_filtered_word(loaded_dict.words[i].str))
 			filtered_dict.words[filtered_dict.sz++] = loaded_dict.words[i];
+		}
+	}
+
+	/* weighted dictionaries are sampled through an alias table, which
+	 * is left empty (sampling uniformly) if unweighted. Words counted 0
+	 * are never generated, so if they're all there is, nothing is. */
+	filtered_alias.sz = 0;
+	if(filtered_dict.counts
+	&& alias_build(&filtered_alias, filtered_dict.counts, filtered_dict.sz) < 0)
+		filtered_dict.sz = 0;
 }
 
 void regen_filtered_quotes(void) {
@@ -1879,15 +2381,56 @@ void revert_rgb_colors(void) {
 	}
 }
 
+void* run_load(void* arg) {
+	LoadJob* const job = arg;
+
+	if(atomic_load(&job->cancelled)) job->ret = -1;
+	else if(job->is_quotes) job->ret = (get_quotes(job->name, job->env, &job->quotes, &job->stream, &job->cancelled) == 0) ? 0 : -1;
+	else job->ret = (get_dict(job->name, job->env, &job->dict, &job->stream, &job->cancelled) == 0) ? 0 : -1;
+
+	atomic_store(&job->done, true);
+	return NULL;
+}
+
+void* run_prefetch(void* arg) {
+	prefetch.ret = gen_text_seed(&prefetch.tt, prefetch.width, prefetch.seed);
+	return NULL;
+}
+
+/* Atomically replace the dictionary cache at $path. */
+int save_dict_cache(const char* path, const Dictionary* dict, const struct stat* src) {
+	const size_t bsz = 4096;
+	char tmp[bsz];
+	FILE* fd;
+	int tfd;
+
+	snprintf(tmp, bsz, "%s.XXXXXX", path);
+	if((tfd = mkstemp(tmp)) < 0)
+		return -1;
+
+	if(!(fd = fdopen(tfd, "w"))) {
+		close(tfd);
+		remove(tmp);
+		return -1;
+	}
+
+	if(write_dict_cache(fd, dict, src) < 0) {
+		fclose(fd);
+		remove(tmp);
+		return -1;
+	}
+
+	if(fclose(fd) == EOF || rename(tmp, path) < 0) {
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
 ScreenNum screen_hist(void) {
-	const char* const re_str = 
-		"^[0-9]{4}-[0-9]{2}-[0-9]{2}-[0-9]{2}:[0-9]{2}:[0-9]{2},[0-9]{3}$";
 	HistScrData* const data = screens[SCR_HIST].data;
 	ScreenNum scrnum;
-	regex_t reg;
-	const size_t bsz = 1024;
-	char buf[bsz];
-	int ret;
 
 	data->is_selected = false;
 	data->selected = 0;
@@ -1899,59 +2442,17 @@ ScreenNum screen_hist(void) {
 		return SCR_MAIN;
 	}
 
-	if((ret = dir_contents(user_hist_dir, &data->hist_files)) < 0) {
-		data->hist_files = NULL;
-		data->nhist = 0;
-	}
-	else { 
-		data->nhist = ret;
-		qsort(data->hist_files, data->nhist, 
-				sizeof(char*), cmp_str_descend);
-	}
-
-	if(data->hist_files) {
-		if(regcomp(&reg, re_str, REG_EXTENDED | REG_NOSUB) != 0) {
-			free_strs(data->hist_files, data->nhist);
-			free(data->hist_files);
-			data->hist_files = NULL;
-		}
-
-		else {
-			for(int i=0; i<data->nhist;) {
-				if(regexec(&reg, data->hist_files[i], 0, NULL, 0) != 0) {
-					strstr_remove(data->hist_files, i);
-					data->nhist--;
-				} else i++;
-			}
-
-			regfree(&reg);
-		}
-
-		for(int i=config.hist_limit; i<data->nhist;) {
-			snprintf(buf, bsz, "%s/%s", user_hist_dir, data->hist_files[i]);
-			if(remove(buf) == 0) {
-				strstr_remove(data->hist_files, i);
-				data->nhist--;
-			}
-
-			else {
-				errlog("Warning: Failed to remove file: %s", buf);
-				i++;
-			}
-		}
-	}
+	/* the last test should be listed, and the history limit may have
+	 * been lowered since. */
+	hist_sync();
+	data->failed = hist_prune(config.hist_limit) < 0;
+	data->nhist = (data->failed) ? 0 : hist_count();
+	prefetch_hist();
 
 	show_panel(data->pan_hist);
 	redraw_hist();
 	scrnum = loop_hist();
 	hide_panel(data->pan_hist);
-
-	if(data->hist_files) {
-		free_strs(data->hist_files, data->nhist);
-		free(data->hist_files);
-	}
-
-	data->hist_files = NULL;
 	return scrnum;
 }
 
@@ -1961,7 +2462,8 @@ ScreenNum screen_main(void) {
 	const int nudge = (config.border ? 1 : 0);
 
 	data->test_started = false;
-	gen_text(&data->tt, getmaxx(data->win_text)-nudge*2);
+	prefetch_take(&data->tt, getmaxx(data->win_text)-nudge*2);
+	prefetch_start(getmaxx(data->win_text)-nudge*2);
 	show_panel(data->pan_text);
 	redraw_main();
 	scrnum = loop_main();
@@ -2006,6 +2508,8 @@ ScreenNum screen_opt(void) {
     OptScrData* const data = screens[SCR_OPT].data;
     ScreenNum scrnum;
 
+	/* options change what's generated; the worker can't be running. */
+	prefetch_cancel();
     show_panel(data->pan_opt);
 	redraw_opt();
 	scrnum = loop_opt();
@@ -2013,11 +2517,67 @@ ScreenNum screen_opt(void) {
 	return scrnum;
 }
 
-int get_dict(const char* name, Dictionary* dict) {
-	int ret;
+/* Replace $loaded_dict with $dict, the $index'th of $dict_files;
+ * taken from $stream if it's output by an executable. */
+void set_loaded_dict(Dictionary dict, int index, Stream* stream) {
+	/* queued history records may still be written against it. */
+	hist_sync();
+	if(loaded_dict.words != stdin_dict.words)
+		free_dict(&loaded_dict);
+
+	/* its strings belong to the stream. */
+	if(loads.dict_stream) stream_close(loads.dict_stream);
+	loaded_dict = dict;
+	loads.idict = index;
+	loads.dict_stream = stream;
+	filtered_dict_valid = false;
+}
+
+/* Replace $loaded_quotes with $quotes, the $index'th of $quotes_files;
+ * taken from $stream if it's output by an executable. */
+void set_loaded_quotes(Quotes quotes, int index, Stream* stream) {
+	if(loaded_quotes.quotes != stdin_quotes.quotes)
+		free_quotes(&loaded_quotes);
+
+	if(loads.quotes_stream) stream_close(loads.quotes_stream);
+	loaded_quotes = quotes;
+	loads.iquote = index;
+	loads.quotes_stream = stream;
+	filtered_quotes_valid = false;
+}
+
+/* Take in what was streamed from stdin and executables since the last
+ * call. Generation must not be running on the worker. */
+void sync_streams(void) {
+	const bool loaded = loaded_dict.words == stdin_dict.words && !loads.dict_stream;
+
+	/* the words may have moved. */
+	if(stdin_stream && stream_dict_update(stdin_stream, &stdin_dict) && loaded) {
+		loaded_dict = stdin_dict;
+		filtered_dict_valid = false;
+	}
+
+	if(loads.dict_stream && stream_dict_update(loads.dict_stream, &loaded_dict))
+		filtered_dict_valid = false;
+
+	if(loads.quotes_stream && stream_quotes_update(loads.quotes_stream, &loaded_quotes))
+		filtered_quotes_valid = false;
+}
+
+/* Load dictionary $name, from its compiled cache if the cache is up to date;
+ * otherwise the dictionary is parsed & the cache (re)written. An executable
+ * dictionary is run with $env and $dict starts out empty; what it outputs
+ * is read into $*stream, which is otherwise set to NULL. Parsing is given
+ * up once $*cancel is set, if $cancel isn't NULL. */
+int get_dict(const char* name, char** env, Dictionary* dict, Stream** stream, const atomic_bool* cancel) {
+	const size_t bsz = 4096;
+	char path_cache[bsz];
+	int ret, fd;
 	struct stat st;
-	FILE* file;
+	FILE* file, *cache;
+	pid_t pid;
 
+	*stream = NULL;
 	file = path_fopen(path_dicts, name);
 	if(!file) return -1;
 	fstat(fileno(file), &st);
@@ -2026,20 +2586,70 @@ int get_dict(const char* name, Dictionary* dict) {
 		return -1;
 	}
 
-	if((ret = load_dictionary(file, dict)) < 0) {
+	if(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) {
+		if(!env || path_find(path_dicts, name, path_cache, bsz) < 0) {
+			fclose(file);
+			return -1;
+		}
+
+		if((fd = exec_spawn(path_cache, env, &pid)) >= 0) {
+			fclose(file);
+			*dict = (Dictionary){.words = NULL, .sz = 0};
+			return (*stream = stream_dict_start(fd, pid, 0, MAX_GEN_WORDS)) ? 0 : -1;
+		}
+
+		/* some filesystems mark every file executable; text is read as is. */
+		if(errno != ENOEXEC && errno != EACCES) {
+			fclose(file);
+			return -1;
+		}
+	}
+
+	if(get_dict_cache_path(path_cache, bsz, name) == 0
+	&& (cache = fopen(path_cache, "r"))) {
+		ret = load_dict_cache(cache, &st, dict);
+		fclose(cache);
+		if(ret == 0) {
+			fclose(file);
+			return 0;
+		}
+	}
+
+	if((ret = load_dictionary(file, dict, cancel)) < 0) {
 		fclose(file);
 		return -1;
 	}
 
 	fclose(file);
+	if(path_cache[0]) save_dict_cache(path_cache, dict, &st);
 	return 0;
 }
 
-int get_quotes(const char* name, Quotes* quotes) {
-	int ret;
+/* $buf is set to the empty string on failure. */
+int get_dict_cache_path(char* buf, size_t sz, const char* name) {
+	buf[0] = '\0';
+	if(!user_cache_dir) return -1;
+	if(snprintf(buf, sz, "%s/%s", user_cache_dir, name) >= (int)sz) {
+		buf[0] = '\0';
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Load quotes-file $name. An executable quotes-file is run with $env and
+ * $quotes starts out empty; what it outputs is read into $*stream, which
+ * is otherwise set to NULL. Parsing is given up once $*cancel is set, if
+ * $cancel isn't NULL. */
+int get_quotes(const char* name, char** env, Quotes* quotes, Stream** stream, const atomic_bool* cancel) {
+	const size_t bsz = 4096;
+	char path[bsz];
+	int ret, fd;
 	struct stat st;
 	FILE* file = path_fopen(path_quotes, name);
+	pid_t pid;
 
+	*stream = NULL;
 	if(!file) return -1;
 	fstat(fileno(file), &st);
 	if(!(st.st_mode & S_IFREG)) { 
@@ -2047,7 +2657,25 @@ int get_quotes(const char* name, Quotes* quotes) {
 		return -1;
 	}
 
-	if((ret = load_quotes(file, quotes)) < 0) {
+	if(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) {
+		if(!env || path_find(path_quotes, name, path, bsz) < 0) {
+			fclose(file);
+			return -1;
+		}
+
+		if((fd = exec_spawn(path, env, &pid)) >= 0) {
+			fclose(file);
+			*quotes = (Quotes){.quotes = NULL, .sz = 0};
+			return (*stream = stream_quotes_start(fd, pid, MAX_GEN_QUOTES)) ? 0 : -1;
+		}
+
+		if(errno != ENOEXEC && errno != EACCES) {
+			fclose(file);
+			return -1;
+		}
+	}
+
+	if((ret = load_quotes(file, quotes, cancel)) < 0) {
 		fclose(file);
 		return -1;
 	}
@@ -2056,8 +2684,6 @@ int get_quotes(const char* name, Quotes* quotes) {
 	return 0;
 }
 
-void sig_nothing(int sig) { /* do nothing */ }
-
 /* return 1 if test is completed */
 int tt_addch(WINDOW* win, TypeText* tt, int ch) {
     Stat* const st = &((StatScrData*)screens[SCR_STAT].data)->st;
@@ -2068,13 +2694,16 @@ int tt_addch(WINDOW* win, TypeText* tt, int ch) {
 	/* move to next word only if the current match length is
 	 * atleast equal to the current word length. */
 	if(ch == ' ' && match->len >= word->len) {
+		tt->sum_wlen += word->len;
 		if(++tt->curr_word == tt->nwords) return 1;
         st->raw_typed++;
         st->raw_correct++;
+		tt_damage(tt, tt->curr_line, tt->curr_line);
 		if(tt->curr_line+1 < tt->nlines
 		&& tt->curr_word == tt->lines[tt->curr_line+1].fword)
 		    tt->curr_line++;
 
+		tt_damage(tt, tt->curr_line, tt->curr_line);
 		return 0;
 	}
 
@@ -2082,156 +2711,240 @@ int tt_addch(WINDOW* win, TypeText* tt, int ch) {
 	 * current word + MAX_ERR. */
 	if(match->len >= word->len + MAX_ERR) return 0;
     st->raw_typed++;
+	tt->ntyped++;
 	match->str[match->len++] = ch;
 	match->str[match->len] = '\0';
-    if(match->len <= word->len && ch == word->str[match->len-1])
+	tt_damage(tt, tt->curr_line, tt->curr_line);
+    if(match->len <= word->len && ch == word->str[match->len-1]) {
         st->raw_correct++;
+		tt->ncorrect++;
+	}
 
     else if(config.ideath) return 1;
 
 	/* if the length of the current match exceeds the length of 
 	 * the current word, the visible-word's size must have increased. */
-    if(match->len > word->len) {
-	    tt->lines[tt->curr_line].len++;
+    if(match->len > word->len)
 		tt_fix_line(tt, tt->curr_line, getmaxx(win)-nudge*2);
-	}
 
 	return 0;
 }
 
+/* mark lines $first to $last (inclusive) as needing to be repainted. */
+void tt_damage(TypeText* tt, int first, int last) {
+	if(tt->dirty_last < 0) {
+		tt->dirty_first = first;
+		tt->dirty_last = last;
+		return;
+	}
+
+	tt->dirty_first = min(tt->dirty_first, first);
+	tt->dirty_last = max(tt->dirty_last, last);
+}
+
 void tt_delch(WINDOW* win, TypeText* tt) {
 	const Word* word = &tt->text[tt->curr_word];
 	Word* match = &tt->matches[tt->curr_word];
 	const int nudge = (config.border ? 1 : 0);
 	const int width = getmaxx(win)-nudge*2;
 
+	tt_damage(tt, tt->curr_line, tt->curr_line);
 	if(match->len == 0) {
-		if(tt->curr_word != 0 
-		&& --tt->curr_word < tt->lines[tt->curr_line].fword)
+		if(tt->curr_word == 0)
+			return;
+
+		if(--tt->curr_word < tt->lines[tt->curr_line].fword)
 			tt->curr_line--;
 
+		tt->sum_wlen -= tt->text[tt->curr_word].len;
+		tt_damage(tt, tt->curr_line, tt->curr_line);
 		return;
 	} 
 
 	match->len--;	
-	match->str[match->len] = '\0';
-	if(match->len >= word->len) {
-		tt->lines[tt->curr_line].len--;
-
-		/* check if the previous line can fit the first word on the current line. */
-		if(tt->curr_line != 0)
-			tt_fix_line(tt, tt->curr_line-1, width);
+	tt->ntyped--;
+	if(match->len < word->len && match->str[match->len] == word->str[match->len])
+		tt->ncorrect--;
 
-		tt_fix_line(tt, tt->curr_line, width);	
-	}
+	match->str[match->len] = '\0';
+	if(match->len >= word->len)
+		tt_fix_line(tt, tt->curr_line, width);
 }	
 
-/* If $line's length exceeds the width of the window, move the
- * last word of $line to the next line (recursively);
- * &
- * If $line can fit the first word on the next line
- * move that word to $line (recursively);
- * &
- * Any line affected by the fix must also be fixed.
-*/
+/* Greedily re-break lines after a word on line $num changed its visual
+ * length (or words were appended). The previous line is included, since
+ * it may now fit the first word of $num. Reflowing stops at the first
+ * line past the current word that still starts on the same word, as
+ * every line after it is unaffected. Reflowed lines are marked damaged. */
 void tt_fix_line(TypeText* tt, int num, int width) {
 	if(!tt->text) return;
 
-	/* check if words need to be moved to the next line. */
-	if(tt->lines[num].len > width) {
-		if(num == tt->nlines-1) {
-			if(tt->nlines++ == tt->lines_cap)
-				tt->lines = ereallocarray(tt->lines, tt->lines_cap*=2, sizeof(Line));
-
-			tt->lines[num+1] = (Line){.fword = tt->nwords, .len = 0};
-			push_word_next(tt, num);
+	const int old_nlines = tt->nlines;
+	const int first = max(0, num-1);
+	int l = first;
+	int w = tt->lines[l].fword;
 
-			/* no need to update last line since we know it contains only 1 word. */
+	for(; w < tt->nwords; l++) {
+		if(l > num && l < old_nlines && tt->lines[l].fword == w 
+		&& w > tt->curr_word) {
+			tt_damage(tt, first, l-1);
+			return;
 		}
 
-		else {
-            push_word_next(tt, num);
-			tt_fix_line(tt, num+1, width); 	
-		}
-		
-		/* update the same line again in case multiple words need to move to the next line. */
-		tt_fix_line(tt, num, width); 
-	}
-	
-	/* if no words were moved to the next line,
-	 * check if words can be moved from the next line. */
-	else if(num != tt->nlines-1
-    && tt->lines[num].len + word_visual_len(tt, tt->lines[num+1].fword) < width) {
-		pull_word_next(tt, num);
-		tt_fix_line(tt, num+1, width); 
-        tt_fix_line(tt, num, width); 
+		if(l == tt->lines_cap)
+			tt->lines = ereallocarray(tt->lines, tt->lines_cap*=2, sizeof(Line));
+
+		/* a line always holds at least one word. */
+		Line* const line = &tt->lines[l];
+		line->fword = w;
+		line->len = word_visual_len(tt, w++) + 1;
+		while(w < tt->nwords && line->len + word_visual_len(tt, w) + 1 <= width)
+			line->len += word_visual_len(tt, w++) + 1;
+
+		if(line->fword <= tt->curr_word && tt->curr_word < w)
+			tt->curr_line = l;
 	}
+
+	/* lines no longer holding any words must be cleared too. */
+	tt_damage(tt, first, max(old_nlines, l)-1);
+	tt->nlines = max(1, l);
 }
 
+/* Break the whole text into lines again, e.g. after a resize. */
 void tt_fix_all_lines(TypeText* tt, int width) {
-    Line* const first = &tt->lines[0];
-
-	/* move all words to the first line */
-    for(int i=1; i<tt->nlines; i++)
-        first->len += tt->lines[i].len;
-
     tt->curr_line = 0;
     tt->nlines = 1;
     tt_fix_line(tt, 0, width);
 }
 
-int write_hist(FILE* fd, const TypeText* tt, const Stat* st) {
-	const double ms = st->elapsed_ms / 1000.0;
+/* Write the history record of the test in $tt, with the stats $st; words
+ * of its text found in $dict, if not NULL, are written as indexes into it. */
+int write_hist(FILE* fd, const TypeText* tt, const Stat* st, const Dictionary* dict) {
 	const int last_typed_word = min(tt->nwords-1, tt->curr_word);
-
-	fprintf(fd, "main-mode: %s\n",          mode_strs[config.main]);
-	fprintf(fd, "instant-death: %s\n",      config.ideath ? "on" : "off");
-	fprintf(fd, "chars-correct: %u/%u\n",   st->ncorrect, st->ntyped);
-	fprintf(fd, "time-elapsed: %.2fs\n",    ms);
-	fprintf(fd, "wpm: %.2f\n",              st->wpm);
-	fprintf(fd, "accuracy: %.2f%%\n",       st->acc);
-	fprintf(fd, "awl: %.2f\n",              st->awl);
-	if(st->author) fprintf(fd, "author: %s\n", st->author);
-	if(st->source) fprintf(fd, "source: %s\n", st->source);
-
-	fputs("\002", fd); /* ascii code STX (start of text) */
 	const int end = (config.main == M_TIMED) ? last_typed_word+1 : tt->nwords;
-	for(int i=0; i<end; i++)
-		fprintf(fd, "%s%c", tt->text[i].str, 0);
+	const int nspooled = min(tt->nretired, MAX_SPOOLED);
+	const HistStats stats = {
+		.seed       = tt->seed,
+		.ncorrect   = st->ncorrect,
+		.ntyped     = st->ntyped,
+		.elapsed_ms = st->elapsed_ms,
+		.wpm        = st->wpm,
+		.acc        = st->acc,
+		.awl        = st->awl,
+		.mode       = config.main,
+		.ideath     = config.ideath,
+	};
+	int ret;
 
-	fputs("\003\n", fd); /* ascii code ETX (end of text) */
+	if((ret = hist_write_header(fd, &stats, st->author, st->source,
+			nspooled + end, nspooled + last_typed_word+1, dict)) < 0)
+		return ret;
 
-	fputs("\002", fd);
+	/* words retired before those spooled are left out of the record. */
+	for(int i=tt->nretired - nspooled; i<tt->nretired && ret == 0; i++) {
+		char slot[SPOOL_SLOT];
+		char* const word = slot, *const match = &slot[MAX_WORD+1];
 
-	for(int i=0; i<=last_typed_word; i++)
-		fprintf(fd, "%s%c", tt->matches[i].str, 0);
+		if(fseek(tt->spool, (i % MAX_SPOOLED) * SPOOL_SLOT, SEEK_SET) < 0
+		|| fread(slot, SPOOL_SLOT, 1, tt->spool) != 1)
+			ret = FILE_ERROR;
+		else ret = hist_write_word(fd, &(Word){word, strlen(word)}, &(Word){match, strlen(match)}, dict);
+	}
 
-	fputs("\003\n", fd);
+	for(int i=0; i<end && ret == 0; i++)
+		ret = hist_write_word(fd, &tt->text[i], (i <= last_typed_word) ? &tt->matches[i] : NULL, dict);
 
-	return 0;
+	return ret;
 }
 
 void tt_init_word(TypeText* tt, const char* buf, size_t word) {
 	const int word_len = strlen(buf);
 	
-	tt->text[word].str = ecalloc(word_len+1, sizeof(char));
+	tt->text[word].str = arena_alloc(&tt->arena, word_len+1, sizeof(char));
 	strcpy(tt->text[word].str, buf);
 	tt->text[word].len = word_len;
-	tt->matches[word].str = ecalloc(word_len + MAX_ERR + 1, sizeof(char));
+	tt->matches[word].str = arena_alloc(&tt->arena, word_len + MAX_ERR + 1, sizeof(char));
 	tt->matches[word].len = '\0';
 	return;
 }
 
+/* Timed tests generate text for as long as they last. Once enough lines
+ * have scrolled well out of view, their words are spooled to a temporary
+ * file for write_hist(); the rest are compacted into the spare arena,
+ * which then takes the place of the current one. The spool is a ring of
+ * MAX_SPOOLED slots, so only the newest retired words are kept for the
+ * record. The running counters already account for retired words.
+ * Retired words can't be returned to with backspace. */
+int tt_retire_lines(TypeText* tt) {
+	const int keep = config.main_height+1;
+	const int nlines = tt->curr_line - keep;
+	Arena arena = tt->arena_spare;
+
+	if(nlines < keep) return 0;
+	if(!tt->spool && !(tt->spool = tmpfile()))
+		return -1;
+
+	const int nret = tt->lines[nlines].fword;
+	const int nwords = tt->nwords - nret;
+	Word* const text = arena_alloc(&arena, nwords, sizeof(Word));
+	Word* const matches = arena_alloc(&arena, nwords, sizeof(Word));
+
+	for(int i=0; i<nret; i++) {
+		char slot[SPOOL_SLOT] = {0};
+
+		snprintf(slot, MAX_WORD+1, "%s", tt->text[i].str);
+		snprintf(&slot[MAX_WORD+1], MAX_WORD+MAX_ERR+1, "%s", tt->matches[i].str);
+		if(fseek(tt->spool, ((tt->nretired + i) % MAX_SPOOLED) * SPOOL_SLOT, SEEK_SET) < 0
+		|| fwrite(slot, SPOOL_SLOT, 1, tt->spool) != 1)
+			return -1;
+	}
+
+	for(int i=0; i<nwords; i++) {
+		const Word* const word = &tt->text[nret+i];
+		const Word* const match = &tt->matches[nret+i];
+
+		text[i].str = arena_alloc(&arena, word->len+1, sizeof(char));
+		text[i].len = word->len;
+		memcpy(text[i].str, word->str, word->len+1);
+		matches[i].str = arena_alloc(&arena, word->len + MAX_ERR + 1, sizeof(char));
+		matches[i].len = match->len;
+		memcpy(matches[i].str, match->str, match->len+1);
+	}
+
+	arena_reset(&tt->arena);
+	tt->arena_spare = tt->arena;
+	tt->arena = arena;
+	tt->text = text;
+	tt->matches = matches;
+	tt->nwords = nwords;
+	tt->curr_word -= nret;
+	tt->nretired += nret;
+
+	tt->nlines -= nlines;
+	tt->curr_line -= nlines;
+	memmove(tt->lines, &tt->lines[nlines], tt->nlines * sizeof(Line));
+	for(int i=0; i<tt->nlines; i++)
+		tt->lines[i].fword -= nret;
+
+	tt_damage(tt, 0, tt->nlines-1);
+	return 0;
+}
+
 inline double wpm(size_t ncorrect, long elapsed_ms) { 
 	return ((12000.0 * ncorrect) / elapsed_ms); }
 
 int main(int argc, char* argv[]) {
+	const struct option longopts[] = {
+		{"seed", required_argument, NULL, 's'},
+		{"reservoir", required_argument, NULL, 'r'},
+		{NULL, 0, NULL, 0},
+	};
     ScreenNum scrnum;
 	int opt;
 
 	progname = argv[0];
 
-	while((opt = getopt(argc, argv, ":hvc:Qw1")) != -1) {
+	while((opt = getopt_long(argc, argv, ":hvc:Qw1s:m:r:", longopts, NULL)) != -1) {
 		switch(opt) {
 			case 'h':
 				puts(HELP_STR);
@@ -2259,9 +2972,59 @@ int main(int argc, char* argv[]) {
 			case '1':
 				ptype_args.oneshot = true;
 				break;
+			case 's': {
+				char* end;
+
+				errno = 0;
+				ptype_args.seed = strtoull(optarg, &end, 0);
+				if(errno || end == optarg || *end) {
+					fprintf(stderr, "%s: option 's' has invalid argument '%s'\n",
+							progname, optarg);
+					exit(2);
+				}
+
+				ptype_args.seeded = true;
+				break;
+			}
+			case 'm': {
+				char* end;
+
+				/* strtoull would negate a leading '-'. */
+				errno = 0;
+				ptype_args.min_words = strtoull(optarg, &end, 10);
+				if(!isdigit((unsigned char)*optarg) || errno || *end
+						|| ptype_args.min_words == 0) {
+					fprintf(stderr, "%s: option 'm' has invalid argument '%s'\n",
+							progname, optarg);
+					exit(2);
+				}
+
+				ptype_args.streamed = true;
+				break;
+			}
+			case 'r': {
+				char* end;
+
+				/* strtoull would negate a leading '-'. */
+				errno = 0;
+				ptype_args.reservoir = strtoull(optarg, &end, 10);
+				if(!isdigit((unsigned char)*optarg) || errno || *end
+						|| ptype_args.reservoir == 0) {
+					fprintf(stderr, "%s: option 'r' has invalid argument '%s'\n",
+							progname, optarg);
+					exit(2);
+				}
+
+				break;
+			}
 			case '?': 
-				fprintf(stderr, "%s: option '%c' is unrecognized\n",
-						progname, optopt);
+				/* an unrecognized long option has no character. */
+				if(optopt)
+					fprintf(stderr, "%s: option '%c' is unrecognized\n",
+							progname, optopt);
+				else fprintf(stderr, "%s: option '%s' is unrecognized\n",
+							progname, argv[optind-1]);
+
 				exit(2);
 			case ':':
 				fprintf(stderr, "%s: option '%c' requires an argument\n", 
@@ -2270,6 +3033,11 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
+	if(ptype_args.streamed && ptype_args.reservoir) {
+		fprintf(stderr, "%s: options 'm' and 'r' can't be combined\n", progname);
+		exit(2);
+	}
+
 	init();
 	scrnum = (config.start_screen) ? SCR_START : SCR_MAIN;
 	while((scrnum = screens[scrnum].run()) != SCR_EXIT);
@@ -6,10 +6,13 @@
 #include <ncurses.h>
 #include <panel.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <dirent.h>
 #include <regex.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define STX 2
 #define ETX 3
@@ -18,6 +21,7 @@
 #define FILE_ERROR 	-1
 #define MEM_ERROR 	-2
 #define PARSE_ERROR -3
+#define CANCELLED   -4
 
 #define MAX_WORD        30
 #define MAX_ERR         4
@@ -27,15 +31,17 @@
 #define MIN_TIMER       0
 #define MAX_TIMER       600
 #define MIN_HIST_LIMIT  0
-#define MAX_HIST_LIMIT  1000
+#define MAX_HIST_LIMIT  100000
 #define MIN_MAIN_WIDTH  MAX_WORD+MAX_ERR+3
 #define MAX_MAIN_WIDTH  80
 #define MIN_MAIN_HEIGHT 1
 #define MAX_MAIN_HEIGHT 21
 #define NUM_ANSI_COLORS 8
 #define HIST_WIN_WIDTH  MAX_WORD+MAX_ERR+3
+#define HIST_DAYS       90 /* days the history summary keeps. */
 #define MAX_STRING_OPT  256
 #define RANGE_OFF_STR "<none>"
+#define ARENA_BLOCK_SIZE 65536
 
 #define SYSTEM_CONFIG   SYSCONFDIR"/ptype"
 #define DIR_DICTS       "dictionaries"
@@ -44,6 +50,7 @@
 #define FILE_CONFIG     "ptype.conf"
 #define DIR_STATE       "ptype"  
 #define DIR_HISTORY     "history"
+#define DIR_DICT_CACHE  "dict-cache"
 
 enum { CP_TEXT=1, CP_TYPED, CP_ERROR, CP_BORDER, 
 	   CP_BKMAIN, CP_SELECTED, CP_WINDOW, CP_SCREEN
@@ -91,20 +98,74 @@ typedef struct {
 typedef struct {
 	Word* words;
 	size_t sz;
+	char* blob;   /* every word's string, stored contiguously. */
+	void* map;    /* mapping $blob lives in, if loaded from a dictionary cache. */
+	size_t sz_map;
+	/* $words is ordered by length; words of length n are
+	 * $words[len_idx[n]] up to, but excluding, $words[len_idx[n+1]]. */
+	size_t len_idx[MAX_WORD+2];
+	uint64_t hash; /* hash of the words' strings, in order (as read, if streamed). */
+	uint32_t* counts; /* frequency of each word, or NULL if unweighted. */
 } Dictionary;
 
 typedef struct {
 	char* author;
 	char* source;
-	Word* text;   /* contents of the quote. */
-	size_t sz;
+	size_t off;   /* offset of the quote's text into the quotes-file. */
+	size_t len;   /* number of bytes the text spans, including the closing '}'. */
+	size_t sz;    /* number of words in the quote. */
 } Quote;
 
 typedef struct {
 	Quote* quotes; /* list of quotes. */
 	size_t sz;
+	char* map;     /* the quotes-file mapped into memory. */
+	size_t sz_map;
 } Quotes;
 
+/* Words or quotes being read from a pipe; see stream.c. */
+typedef struct Stream Stream;
+
+/* A dictionary or quotes-file being loaded on a worker thread. */
+typedef struct {
+	pthread_t thread;
+	const char* name;
+	int index;              /* into dict_files or quotes_files. */
+	char** env;             /* environment executables are run with. */
+	bool is_quotes;
+	bool threaded;          /* whether $thread was started. */
+	atomic_bool cancelled;  /* superseded; the result will be discarded. */
+	atomic_bool done;
+	int ret;
+	Dictionary dict;
+	Quotes quotes;
+	Stream* stream;         /* $dict or $quotes is taken from, if output by an executable. */
+} LoadJob;
+
+typedef struct ArenaBlock {
+	struct ArenaBlock* prev; /* previously filled block. */
+	size_t sz;               /* number of bytes in $data. */
+	size_t used;             /* number of bytes handed out from $data. */
+	max_align_t data[];
+} ArenaBlock;
+
+typedef struct {
+	ArenaBlock* head; /* block allocations are currently made from. */
+} Arena;
+
+/* xoshiro256** generator state. */
+typedef struct {
+	uint64_t s[4];
+} Rng;
+
+/* Vose alias table: column i is picked with $prob[i],
+ * otherwise its alias $alias[i] is. */
+typedef struct {
+	double* prob;
+	uint32_t* alias;
+	size_t sz;
+} AliasTable;
+
 typedef struct {
 	int fword; /* first word on line. */
 	int len;   /* accumulative length of words on the line */
@@ -116,11 +177,22 @@ typedef struct {
 	Line* lines;        /* holds information necessary for formatting lines. */
 	int nwords;         /* size of text and matches. */
 	int curr_word;      /* the word the user is currently attempting to type. */
+	int nretired;       /* number of words retired before $text[0] (timed mode). */
+	int ntyped;         /* number of characters currently in $matches. */
+	int ncorrect;       /* number of those characters matching $text. */
+	int sum_wlen;       /* sum of the lengths of the words before $curr_word. */
 	int lines_cap;      /* number of elements currently allocated in lines. */
 	int nlines;         /* number of lines. */
 	int curr_line;      /* the line that curr_word appears on. */
+	int dirty_first;    /* first line that needs to be repainted. */
+	int dirty_last;     /* last line that needs to be repainted (< 0 if none). */
     const char* author;
     const char* source;
+	Arena arena;        /* backs $text, $matches and their strings. */
+	Arena arena_spare;  /* $arena is compacted into this when words are retired. */
+	FILE* spool;        /* the newest retired words & their matches; see tt_retire_lines(). */
+	uint64_t seed;      /* $rng was seeded with this; replays the test. */
+	Rng rng;            /* generates the words of the test. */
 } TypeText;
 
 typedef struct {
@@ -128,6 +200,19 @@ typedef struct {
 	enum {PUNCT_POSTFIX, PUNCT_CIRCUMFIX} type;
 } Punctuation;
 
+/* Punctuation is picked with probability proportional to its share of
+ * the cumulative weights; an entry of length 0 only capitalizes. */
+typedef struct {
+	Punctuation punct;
+	int len;      /* strlen($punct.str). */
+	unsigned cum; /* weight of this and every preceding entry. */
+} PunctEntry;
+
+typedef struct {
+	PunctEntry* entries;
+	size_t sz;
+} PunctTable;
+
 typedef struct {
     attr_t border;
     attr_t text;
@@ -190,11 +275,67 @@ typedef struct {
 	NameVal* stats;
 	Word* text;
 	Word* matches;
+	char* strs;      /* every string of $stats, $text and $matches. */
 	int nwords;
 	int nmatches;
 	int sz_stats;
 } History;
 
+/* The stats of a test, as stored at the head of its history record. */
+typedef struct {
+	uint64_t seed;
+	uint32_t ncorrect;
+	uint32_t ntyped;
+	uint32_t elapsed_ms;
+	float wpm;
+	float acc;
+	float awl;
+	uint8_t mode;
+	uint8_t ideath;
+	uint8_t pad[6];
+} HistStats;
+
+/* The tests of a day, in the history summary. */
+typedef struct {
+	int32_t day;       /* days since the epoch, in local time. */
+	uint32_t ntests;
+	double sum_wpm;
+	double sum_acc;
+} HistDay;
+
+/* The tests of a main mode, in the history summary. */
+typedef struct {
+	uint32_t ntests;
+	float best_wpm;
+	double sum_wpm;
+	double sum_acc;
+	int64_t best_time; /* when the test with $best_wpm ended. */
+} HistModeSum;
+
+/* Aggregates of every test added to the history, kept up to date as tests
+ * are added so they never need the records. */
+typedef struct {
+	uint64_t ntests;
+	uint64_t elapsed_ms;
+	uint64_t ntyped;
+	uint64_t ncorrect;
+	int64_t first_time;            /* when the first test ended. */
+	HistModeSum modes[NUM_MODES];
+	HistDay days[HIST_DAYS];       /* the newest days, $day % HIST_DAYS. */
+} HistSummary;
+
+/* A record's entry in the history index. */
+typedef struct {
+	int64_t time;   /* milliseconds since the epoch the test ended at. */
+	uint32_t seg;   /* segment file the record is in. */
+	uint32_t off;   /* offset of the record's length prefix into $seg. */
+	uint32_t len;   /* length of the record. */
+	float wpm;
+	float acc;
+	uint8_t mode;
+	uint8_t pad[3];
+} HistEntry;
+
 typedef struct {
 	bool* toggle;     /* pointer to togglable variable in global config. */
     int(*func)(void); /* function to call after updating option. */
@@ -212,6 +353,9 @@ typedef struct {
 	char** list;      /* list to select from. */
 	int len_list;     /* length of the list. */
 	int(*func)(void); /* function to call after updating option. */
+	/* if set, $func is only called once the selection settles and
+	 * loads it in the background; true while it does. */
+	const bool* loading;
 } OptSelect;
 
 typedef struct {
@@ -250,6 +394,7 @@ typedef struct {
 	WINDOW* win_text;           /* window the test text appears in. */
 	PANEL* pan_text;            /* win_text panel. */
 	TypeText tt;                /* all data related to the currently generated test. */
+	int view_start;             /* first line of text shown by the last full redraw. */
 	bool test_started;
 	struct timespec time_start;
 } MainScrData;
@@ -279,14 +424,19 @@ typedef struct {
 typedef struct {
 	WINDOW* win_hist;  /* history & stats displayed here. */
 	PANEL* pan_hist;   /* win_hist panel; */
-	char** hist_files; /* history list. */
 	char* errmsg; 
-	int nhist;         /* number of history files. */
-	bool is_selected;  /* is $st loaded. */
-	int selected;      /* index into $hist_files. */
+	bool failed;       /* couldn't read the history. */
+	int nhist;         /* number of tests in the history. */
+	bool is_selected;  /* is $hist loaded. */
+	bool show_trends;  /* is $sum displayed. */
+	int selected;      /* index of the test, newest first. */
 	int nlines;        /* number of lines in the history text. */
 	int first_line;    /* first line to display on screen in history text. */
-	History hist;
+	HistEntry entry;   /* index entry of $hist. */
+	const History* hist; /* kept by the history's cache; see hist_fetch(). */
+	HistSummary sum;
+	HistDay days[HIST_DAYS]; /* days of $sum with tests, newest first. */
+	int ndays;
 } HistScrData;
 
 typedef ScreenNum(*FRun)(void);
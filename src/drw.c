@@ -5,10 +5,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "drw.h"
 #include "def.h"
 #include "utils.h"
+#include "hist.h"
 #include "aart.h"
 
 extern Screen* screens;
@@ -16,28 +18,42 @@ extern Config config;
 extern GlobalAttrs attributes;
 extern char* mode_strs[];
 extern void tt_fix_all_lines(TypeText*, int width);
+extern void num_chars_typed(const TypeText*, int*, int*);
+extern double accuracy(size_t, size_t);
+extern double wpm(size_t, long);
 
 static inline bool win_changed(WINDOW* win, int ny, int nx, int nh, int nw) {
     return ny != getbegy(win) || nx != getbegx(win)
         || nh != getmaxy(win) || nw != getmaxx(win);
 }
 
-static inline void add_error(WINDOW* win, int ch) {
-    wattron(win, attributes.error);
-    waddch(win, ch);
-    wattroff(win, attributes.error);
-}
+/* $ch with $attr, rendered against $win's background the way waddch() would. */
+static inline chtype mkcell(WINDOW* win, int ch, attr_t attr) {
+	const chtype bkgd = getbkgd(win);
+	chtype cell = (unsigned char)ch | attr | (bkgd & A_ATTRIBUTES & ~A_COLOR);
+
+	if(!(cell & A_COLOR))
+		cell |= bkgd & A_COLOR;
 
-static inline void add_text(WINDOW* win, int ch) {
-    wattron(win, attributes.text);
-    waddch(win, ch);
-    wattroff(win, attributes.text);
+	return cell;
 }
 
-static inline void add_typed(WINDOW* win, int ch) {
-    wattron(win, attributes.typed);
-    waddch(win, ch);
-    wattroff(win, attributes.typed);
+/* Write a run of cells with a single call. waddchnstr() stores cells
+ * verbatim, so runs holding anything but printable ASCII (e.g. a multibyte
+ * character) are written a byte at a time instead. */
+static void mvwadd_run(WINDOW* win, int y, int x, const chtype* run, int n) {
+	for(int i=0; i<n; i++) {
+		const int ch = run[i] & A_CHARTEXT;
+		if(ch < ' ' || ch > '~') {
+			wmove(win, y, x);
+			for(int j=0; j<n; j++)
+				waddch(win, run[j]);
+
+			return;
+		}
+	}
+
+	mvwaddchnstr(win, y, x, run, n);
 }
 
 /* $lines is the size of the window; $sz is the size of the list.
@@ -158,7 +174,11 @@ static void print_option(WINDOW* win, int y, int x, const Option* opt, bool hove
 				? opt->select.list[*opt->select.selected]
 			    : "Empty";
 
-            snprintf_fit(buf, bsz, rwidth, "%s", opt_str);
+			if(opt->select.loading && *opt->select.loading)
+				snprintf_fit(buf, bsz, rwidth, "%s (loading...)", opt_str);
+			else
+				snprintf_fit(buf, bsz, rwidth, "%s", opt_str);
+
 			if(hover && selected)
 				wattron(win, A_UNDERLINE);
 
@@ -210,13 +230,14 @@ static void update_test_timer(const TypeText* tt) {
 		return;
 	}
 
+	/* shown to a tenth of a second, rounded up so 0 is only shown at the end. */
 	else if(data->test_started) {
 		struct timespec now;
-		long elapsed;
+		long left;
 
 		clock_gettime(CLOCK_MONOTONIC, &now);
-		elapsed = elapsed_ms(&data->time_start, &now)/1e3;
-		sprintf(time_str, "%lu", config.timer - elapsed);
+		left = max(0, config.timer*1000L - elapsed_ms(&data->time_start, &now));
+		sprintf(time_str, "%ld.%ld", (left+99)/1000, (left+99)/100 % 10);
 	}
 
 	else
@@ -226,6 +247,27 @@ static void update_test_timer(const TypeText* tt) {
 			whalignstr_center(data->win_text, time_str), "%ss", time_str);
 }
 
+/* live wpm and accuracy, drawn into the bottom border. */
+static void update_test_stats(WINDOW* win, const TypeText* tt) {
+	MainScrData* const data = screens[SCR_MAIN].data;
+	const Stat* const st = &((StatScrData*)screens[SCR_STAT].data)->st;
+	struct timespec now;
+	char buf[64];
+	int ntyped, ncorrect;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const long ms = elapsed_ms(&data->time_start, &now);
+	num_chars_typed(tt, &ntyped, &ncorrect);
+
+	snprintf(buf, sizeof(buf), "WPM: %.0f Acc: %.0f%%",
+		(ms > 0) ? wpm(ncorrect, ms) : 0.0,
+		(st->raw_typed) ? accuracy(st->raw_typed, st->raw_correct) : 100.0);
+
+	wattron(win, attributes.border);
+	mvwaddstr(win, getmaxy(win)-1, walignstr_right(win, buf, 1), buf);
+	wattroff(win, attributes.border);
+}
+
 static void update_win_curs(WINDOW* win, const TypeText* tt) {
 	const int nudge = (config.border ? 1 : 0);
     const int fword = tt->lines[tt->curr_line].fword;
@@ -264,32 +306,52 @@ static void update_win_info(WINDOW* win, const TypeText* tt) {
 		mvwprintw(win, 0, walignstr_right(win, ideath_str, nudge), "%s", ideath_str);
 		wattroff(win, attributes.error);
 	}
+
+	if(config.border && ((MainScrData*)screens[SCR_MAIN].data)->test_started)
+		update_test_stats(win, tt);
 }
 
 static void update_win_word(WINDOW* win, const TypeText* tt, int line_num, int word_num, int y, int x) {
 	const Word* word = &tt->text[word_num];
 	const Word* match = &tt->matches[word_num];
-
-	wmove(win, y, x);
-
+	chtype run[MAX_WORD+MAX_ERR+1];
 	int i = 0;
+
 	for(; i<word->len; i++) {
-		if(match->len <= i) {
-			add_text(win, word->str[i]);
-			continue;
-		}
+		const attr_t attr = (match->len <= i) ? attributes.text
+			: (match->str[i] == word->str[i]) ? attributes.typed
+			: attributes.error;
 
-		(match->str[i] == word->str[i])
-			? add_typed(win, word->str[i])
-			: add_error(win, word->str[i]);
+		run[i] = mkcell(win, word->str[i], attr);
 	}
 
 	for(; i<match->len; i++)
-		add_error(win, match->str[i]);
+		run[i] = mkcell(win, match->str[i], attributes.error);
 
-    (word_num < tt->curr_word)
-	    ? add_typed(win, ' ')
-		: add_text(win, ' ');
+	run[i++] = mkcell(win, ' ', 
+		(word_num < tt->curr_word) ? attributes.typed : attributes.text);
+
+	mvwadd_run(win, y, x, run, i);
+}
+
+/* draw the words on line $line_num at row $y, return the column after them. */
+static int update_win_line(WINDOW* win, const TypeText* tt, int line_num, int y) {
+	const int end_word = (line_num == tt->nlines-1) 
+		? tt->nwords : tt->lines[line_num+1].fword;
+	int x = (config.border ? 1 : 0);
+
+	for(int j=tt->lines[line_num].fword; j<end_word; j++) { 
+		update_win_word(win, tt, line_num, j, y, x);
+		x += word_visual_len(tt, j) + 1;
+	}
+
+	return x;
+}
+
+/* the first line of text visible in $win; the current line is kept centered. */
+static int text_view_start(WINDOW* win, const TypeText* tt) {
+	const int nudge = (config.border ? 1 : 0);
+	return max(0, tt->curr_line - (getmaxy(win)-1-nudge)/2);
 }
 
 static void update_win_text(WINDOW* win, TypeText* tt) {
@@ -306,20 +368,10 @@ static void update_win_text(WINDOW* win, TypeText* tt) {
 		return;
 	}
 	
-	const int start = max(0, tt->curr_line - (getmaxy(win)-1-nudge)/2); 
+	const int start = text_view_start(win, tt);
 	const int end   = min(tt->nlines, start + getmaxy(win)-1-nudge);
-	for(int i=start; i<end; i++) { 
-		const int end_word = (i == tt->nlines-1) 
-            ? tt->nwords : tt->lines[i+1].fword;
-
-		x = nudge;
-		for(int j=tt->lines[i].fword; j<end_word; j++) { 
-			update_win_word(win, tt, i, j, y, x);
-			x += word_visual_len(tt, j) + 1;
-		}
-
-		y++;
-	}
+	for(int i=start; i<end; i++)
+		update_win_line(win, tt, i, y++);
 
 	update_win_curs(win, tt);
 }
@@ -347,7 +399,47 @@ void redraw_main(void) {
 
 	update_win_info(win, &data->tt);
     update_win_text(win, &data->tt);
+	data->view_start = text_view_start(win, &data->tt);
+	data->tt.dirty_last = -1;
+
+	update_panels();
+	doupdate();
+}
+
+/* Repaint only the lines of text damaged since the last redraw, and the
+ * info row. Falls back to redraw_main() when the text has scrolled. */
+void update_main(void) {
+	MainScrData* const data = screens[SCR_MAIN].data;
+    WINDOW* const win = data->win_text;
+	TypeText* const tt = &data->tt;
+	const int nudge = (config.border ? 1 : 0);
+	const int xend = getmaxx(win)-nudge;
+	const int start = data->view_start;
+	const int end = start + getmaxy(win)-1-nudge;
+
+	if(!tt->text || text_view_start(win, tt) != start) {
+		redraw_main();
+		return;
+	}
 
+	/* the timer's width may have shrunk. */
+	wmove(win, 0, 0);
+	wclrtoeol(win);
+	update_win_info(win, tt);
+
+	if(tt->dirty_last >= 0) {
+		for(int i=max(start, tt->dirty_first); i<=min(end-1, tt->dirty_last); i++) {
+			const int y = i-start+1;
+			const int x = (i < tt->nlines) ? update_win_line(win, tt, i, y) : nudge;
+
+			/* blank whatever the line held before. */
+			mvwhline(win, y, x, ' ', xend-x);
+		}
+
+		tt->dirty_last = -1;
+	}
+
+	update_win_curs(win, tt);
 	update_panels();
 	doupdate();
 }
@@ -492,16 +584,17 @@ static void redraw_hist_files(void) {
 	const size_t bsz = 32;
 	char buf[bsz];
 
-	if(data->hist_files) {
+	if(!data->failed) {
 		if(data->nhist) {
 			/* number of lines where a file can be displayed */
 			const int lines = getmaxy(win)-nudge-1;
 
 			int start = scroll_list(lines, data->selected, data->nhist);
 			for(int i=start; (i-start) < lines && i<data->nhist; i++) {
-				/* don't copy milliseconds or seconds from file name. */
-				memcpy(buf, data->hist_files[i], 16);
-				buf[16] = '\0';
+				HistEntry e;
+
+				if(hist_entry(i, &e) < 0) continue;
+				hist_time_str(&e, buf, bsz);
 
 				const int x = whalignstr_center(win, buf)+1;
 				if(i == data->selected) wattron(win, attributes.selected);
@@ -532,40 +625,35 @@ static void redraw_hist_files(void) {
 	wattroff(win, attributes.border);
 }
 
+/* anything past HIST_WIN_WIDTH would be clipped by the window anyway. */
 static void mvwadd_diff(WINDOW* win, int y, int x, const Word* word, const Word* match) {
-	const Word* w1 = word;
-	const Word* w2 = match;
-	int attr;
-
-	if(!match) {
-		wattron(win, attributes.text);
-		mvwaddstr(win, y, x, word->str);
-		wattroff(win, attributes.text);
-		return;
+	chtype run[HIST_WIN_WIDTH];
+	const int mlen = (match) ? match->len : 0;
+	const int n = min(max(word->len, mlen), HIST_WIN_WIDTH);
+
+	for(int i=0; i<n; i++) {
+		if(i >= word->len)
+			run[i] = mkcell(win, match->str[i], attributes.error);
+		else if(i >= mlen)
+			run[i] = mkcell(win, word->str[i], attributes.text);
+		else
+			run[i] = mkcell(win, word->str[i], (word->str[i] == match->str[i])
+				? attributes.typed : attributes.error);
 	}
 
-	int i=0;
-	for(; i < w1->len && i < w2->len; i++) {
-		attr = (w1->str[i] == w2->str[i])
-			? attributes.typed
-			: attributes.error;
-
-		wattron(win, attr);
-		mvwaddch(win, y, x+i, w1->str[i]);
-		wattroff(win, attr);
-	}
+	mvwadd_run(win, y, x, run, n);
+}
 
-	attr = attributes.text;
-	if(w1->len < w2->len) {
-		w1 = match;
-		w2 = word;
-		attr = attributes.error;
+/* draw a horizontal rule across $win at $y, joined to the border. */
+static void draw_rule(WINDOW* win, int y) {
+	wattron(win, attributes.border);
+	mvwhline(win, y, 0, ACS_HLINE, getmaxx(win));
+	if(config.border) {
+		mvwaddch(win, y, 0, ACS_LTEE);
+		mvwaddch(win, y, getmaxx(win)-1, ACS_RTEE);
 	}
 
-	wattron(win, attr);
-	for(; i < w1->len; i++)
-		mvwaddch(win, y, x+i, w1->str[i]);
-	wattroff(win, attr);
+	wattroff(win, attributes.border);
 }
 
 static void redraw_hist_stat(void) {
@@ -578,9 +666,9 @@ static void redraw_hist_stat(void) {
 
 	int i=0;
 	/* the arbitrary '-5' is to save 5 lines for the following history text. */
-	for(; data->hist.stats[i].name && i+1 < getmaxy(win)-1-nudge-5; i++) {
-		const char* const name = data->hist.stats[i].name;
-		const char* const val = data->hist.stats[i].val;
+	for(; data->hist->stats[i].name && i+1 < getmaxy(win)-1-nudge-5; i++) {
+		const char* const name = data->hist->stats[i].name;
+		const char* const val = data->hist->stats[i].val;
 		const int val_w = getmaxx(win)-(nudge*2) - (strlen(name)+2);
 
 		mvwaddstr(win, i+1, nudge, name);
@@ -589,25 +677,18 @@ static void redraw_hist_stat(void) {
 		mvwaddstr(win, i+1, val_x, buf);
 	}
 
-	wattron(win, attributes.border);
-	mvwhline(win, i+1, 0, ACS_HLINE, getmaxx(win));
-	if(config.border) {
-		mvwaddch(win, i+1, 0, ACS_LTEE);
-		mvwaddch(win, i+1, getmaxx(win)-1, ACS_RTEE);
-	}
-
-	wattroff(win, attributes.border);
+	draw_rule(win, i+1);
 
 	const int y_text = i+2;
 	const int h_text = getmaxy(win)-y_text-nudge;
 	int x = nudge;
 	int line = 0;
-	for(int j=0; j<data->hist.nwords; j++) {
-		const Word* const word  = &data->hist.text[j];
+	for(int j=0; j<data->hist->nwords; j++) {
+		const Word* const word  = &data->hist->text[j];
 		const Word* match = NULL;
 		int len = word->len;
-		if(j < data->hist.nmatches) {
-			match = &data->hist.matches[j];
+		if(j < data->hist->nmatches) {
+			match = &data->hist->matches[j];
 			len = max(word->len, match->len);
 		}
 
@@ -626,13 +707,60 @@ static void redraw_hist_stat(void) {
 		x += len+1;
 	}
 
-	memcpy(buf, data->hist_files[data->selected], 16);
-	buf[16] = '\0';
+	hist_time_str(&data->entry, buf, bsz);
 	wattron(win, attributes.border);
 	mvwaddstr(win, 0, nudge, buf);
 	wattroff(win, attributes.border);
 }
 
+static void redraw_hist_trends(void) {
+	HistScrData* const data = screens[SCR_HIST].data;
+	const HistSummary* const sum = &data->sum;
+	WINDOW* const win = data->win_hist;
+	const int nudge = config.border ? 1 : 0;
+	const size_t bsz = 64;
+	char buf[bsz];
+	int line = 1;
+
+	print_label_val(win, line++, "Tests", "%"PRIu64, sum->ntests);
+	print_label_val(win, line++, "Time typing", "%"PRIu64"h %02"PRIu64"m",
+		sum->elapsed_ms / 3600000, sum->elapsed_ms / 60000 % 60);
+	print_label_val(win, line++, "Letters correct", "%6.2f%%",
+		(sum->ntyped) ? (double)sum->ncorrect / sum->ntyped * 100 : 0.0);
+	if(sum->ntests) {
+		hist_time_str(&(HistEntry){.time = sum->first_time}, buf, bsz);
+		print_label_val(win, line++, "Since", "%s", buf);
+	}
+
+	draw_rule(win, line++);
+	wattron(win, attributes.border);
+	mvwprintw(win, line++, nudge, "%-8s %5s %6s %6s", "Mode", "Tests", "Avg", "Best");
+	wattroff(win, attributes.border);
+	for(int m=0; m<NUM_MODES; m++) {
+		const HistModeSum* const ms = &sum->modes[m];
+		const double avg = (ms->ntests) ? ms->sum_wpm / ms->ntests : 0.0;
+
+		mvwprintw(win, line++, nudge, "%-8s %5"PRIu32" %6.2f %6.2f",
+			mode_strs[m], ms->ntests, avg, ms->best_wpm);
+	}
+
+	draw_rule(win, line++);
+	wattron(win, attributes.border);
+	mvwprintw(win, line++, nudge, "%-10s %5s %6s %7s", "Day", "Tests", "Wpm", "Acc");
+	wattroff(win, attributes.border);
+	for(int i=data->first_line; i<data->ndays && line < getmaxy(win)-nudge; i++) {
+		const HistDay* const d = &data->days[i];
+
+		hist_day_str(d->day, buf, bsz);
+		mvwprintw(win, line++, nudge, "%-10s %5"PRIu32" %6.2f %6.2f%%",
+			buf, d->ntests, d->sum_wpm / d->ntests, d->sum_acc / d->ntests);
+	}
+
+	wattron(win, attributes.border);
+	mvwaddstr(win, 0, 1, "Trends");
+	wattroff(win, attributes.border);
+}
+
 void redraw_hist(void) {
 	HistScrData* const data = screens[SCR_HIST].data;
 	WINDOW* const win = data->win_hist;
@@ -668,9 +796,9 @@ void redraw_hist(void) {
 		mvwaddstr(win, y, x, buf);
 		wattroff(win, attributes.error);
 	} else {
-		(data->is_selected)
-		    ? redraw_hist_stat()
-			: redraw_hist_files();
+		if(data->is_selected) redraw_hist_stat();
+		else if(data->show_trends) redraw_hist_trends();
+		else redraw_hist_files();
 	}
 
 	update_panels();
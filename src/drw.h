@@ -6,5 +6,6 @@ void redraw_start(void);
 void redraw_stat(void);
 void redraw_opt(void);
 void redraw_hist(void);
+void update_main(void);
 
 #endif /* DRW_H */
@@ -0,0 +1,149 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <regex.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "filter.h"
+#include "def.h"
+#include "utils.h"
+
+#define FILTER_CACHE_SIZE  8
+#define FILTER_MAX_THREADS 16
+#define FILTER_MIN_CHUNK   8192 /* fewer words than this aren't worth a thread. */
+
+/* The result of filtering the words $lo up to $hi of a dictionary
+ * with a regular expression; bit i of $bits is set if word $lo+i matched. */
+typedef struct {
+	uint64_t hash;              /* Dictionary.hash. */
+	size_t sz;                  /* Dictionary.sz. */
+	size_t lo;
+	size_t hi;
+	char re[MAX_STRING_OPT];
+	uint64_t* bits;             /* NULL if the entry is unused. */
+	unsigned long last_used;
+} FilterEntry;
+
+/* A contiguous share of the words to filter. Every share but the last
+ * spans a multiple of 64 words, so no two threads write the same
+ * element of $bits. */
+typedef struct {
+	const Word* words;
+	size_t lo;
+	size_t hi;
+	size_t base;        /* the word $bits[0] starts at. */
+	uint64_t* bits;
+	const char* re;
+	int ret;
+} FilterJob;
+
+static FilterEntry cache[FILTER_CACHE_SIZE];
+static unsigned long use_count = 0;
+
+/* glibc serializes regexec() calls on the same regex_t,
+ * so each job compiles its own. */
+static void* run_filter_job(void* arg) {
+	FilterJob* const job = arg;
+	regex_t re;
+
+	if(regcomp(&re, job->re, REG_EXTENDED | REG_NOSUB) != 0) {
+		job->ret = -1;
+		return NULL;
+	}
+
+	for(size_t i=job->lo; i<job->hi; i++)
+		if(regexec(&re, job->words[i].str, 0, NULL, 0) == 0)
+			job->bits[(i-job->base)/64] |= UINT64_C(1) << ((i-job->base)%64);
+
+	regfree(&re);
+	job->ret = 0;
+	return NULL;
+}
+
+static int filter_parallel(const Dictionary* dict, size_t lo, size_t hi, const char* re, uint64_t* bits) {
+	FilterJob jobs[FILTER_MAX_THREADS];
+	pthread_t threads[FILTER_MAX_THREADS];
+	bool started[FILTER_MAX_THREADS] = {false};
+	const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t njobs = (hi-lo) / FILTER_MIN_CHUNK;
+	int ret = 0;
+
+	if(njobs > FILTER_MAX_THREADS) njobs = FILTER_MAX_THREADS;
+	if(ncpus > 0 && njobs > (size_t)ncpus) njobs = ncpus;
+	if(njobs == 0) njobs = 1;
+
+	const size_t chunk = (((hi-lo) + njobs-1) / njobs + 63) & ~(size_t)63;
+	for(size_t i=0; i<njobs; i++) {
+		const size_t start = lo + i*chunk;
+
+		jobs[i] = (FilterJob){
+			.words = dict->words,
+			.lo    = (start < hi) ? start : hi,
+			.hi    = (start+chunk < hi) ? start+chunk : hi,
+			.base  = lo,
+			.bits  = bits,
+			.re    = re,
+		};
+
+		/* the first share is filtered on this thread. */
+		if(i > 0)
+			started[i] = pthread_create(&threads[i], NULL, run_filter_job, &jobs[i]) == 0;
+	}
+
+	for(size_t i=0; i<njobs; i++) {
+		if(started[i]) pthread_join(threads[i], NULL);
+		else run_filter_job(&jobs[i]);
+
+		if(jobs[i].ret < 0) ret = -1;
+	}
+
+	return ret;
+}
+
+/* Return a bitset of which words $lo up to $hi of $dict match the
+ * regular expression $re, or NULL on failure. Results are cached, so
+ * the bitset is only valid until the next call. */
+const uint64_t* filter_words(const Dictionary* dict, size_t lo, size_t hi, const char* re) {
+	FilterEntry* victim = &cache[0];
+	uint64_t* bits;
+
+	for(size_t i=0; i<FILTER_CACHE_SIZE; i++) {
+		FilterEntry* const e = &cache[i];
+
+		if(e->bits && e->hash == dict->hash && e->sz == dict->sz
+		&& e->lo == lo && e->hi == hi && streq(e->re, re)) {
+			e->last_used = ++use_count;
+			return e->bits;
+		}
+
+		if(!e->bits || (victim->bits && e->last_used < victim->last_used))
+			victim = e;
+	}
+
+	if(strlen(re) >= MAX_STRING_OPT)
+		return NULL;
+
+	if(!(bits = calloc((hi-lo)/64 + 1, sizeof(uint64_t))))
+		return NULL;
+
+	if(filter_parallel(dict, lo, hi, re, bits) < 0) {
+		free(bits);
+		return NULL;
+	}
+
+	free(victim->bits);
+	*victim = (FilterEntry){
+		.hash      = dict->hash,
+		.sz        = dict->sz,
+		.lo        = lo,
+		.hi        = hi,
+		.bits      = bits,
+		.last_used = ++use_count,
+	};
+
+	strcpy(victim->re, re);
+	return bits;
+}
@@ -0,0 +1,10 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+#include "def.h"
+
+const uint64_t* filter_words(const Dictionary*, size_t, size_t, const char*);
+
+#endif /* FILTER_H */
@@ -0,0 +1,1597 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "hist.h"
+#include "def.h"
+#include "utils.h"
+#include "loaders.h"
+
+#define HIST_INDEX_MAGIC   "PTHI"
+#define HIST_INDEX_VERSION 2
+#define HIST_INDEX_NAME    "index"
+#define HIST_SUM_MAGIC     "PTHS"
+#define HIST_SUM_VERSION   1
+#define HIST_SUM_NAME      "summary"
+#define HIST_SEG_MAX       (1 << 20) /* a segment is full past this many bytes. */
+#define HIST_COMPACT_MIN   1024      /* dead entries worth compacting the index for. */
+#define HIST_REC_MAGIC     "PTHR"
+#define HIST_REC_VERSION   1
+#define HIST_REC_STATS     10        /* stats shown for a record. */
+#define HIST_QUEUE_MAX     16        /* records waiting to be written before queueing blocks. */
+#define HIST_PAGE_LEN      256       /* index entries read at a time. */
+#define HIST_PAGES         4         /* pages of them kept. */
+#define HIST_CACHE_MAX     8         /* parsed records kept. */
+#define HIST_WANT_MAX      3         /* records waiting to be parsed in the background. */
+
+extern char* mode_strs[];
+
+/* The history is kept as append-only segment files of records, each a
+ * uint32_t length followed by the record itself, and an index of one
+ * fixed-size HistEntry per record, oldest first. Entries before $start
+ * are past the history limit, and their tests are summarized in $pruned;
+ * every segment before $oldest_seg has been removed, and records are
+ * appended to $cur_seg. */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t start;
+	uint32_t oldest_seg;
+	uint32_t cur_seg;
+	HistSummary pruned;
+} HistIndexHeader;
+
+/* The header of an index from before it kept $pruned. */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t start;
+	uint32_t oldest_seg;
+	uint32_t cur_seg;
+} HistIndexHeaderV1;
+
+/* A record is this header, its author's and source's strings, then each
+ * word of the text as a varint: twice the word's index into the dictionary
+ * hashing to $dict, or one more than twice the length of the word, which
+ * follows it. The first $nmatches words are each followed by what was
+ * typed for them as a diff against the word: a varint that is 0 for an
+ * exact match, otherwise one more than the length of the prefix shared
+ * with the word, followed by a varint length & the rest of what was typed.
+ * The dictionary is kept beside the segments as "<dict>-<seg>.dict", $seg
+ * being the newest segment with a record using it. */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t dict;    /* Dictionary.hash, or 0 if no words index into one. */
+	HistStats stats;
+	uint32_t nwords;
+	uint32_t nmatches;
+	uint16_t len_author;
+	uint16_t len_source;
+	uint32_t pad;
+} HistRecordHeader;
+
+/* The summary is this header followed by a HistSummary. It's only
+ * written with the index locked. */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+} HistSummaryHeader;
+
+/* The index's lock is per process, so $lock keeps the writer thread &
+ * the UI from using the store at the same time. */
+static struct {
+	pthread_mutex_t lock;
+	char* dir;
+	int fd;         /* the index, or -1 if the history isn't open. */
+	struct stat st; /* of $fd when it was opened. */
+	int sum_fd;     /* the summary, or -1 if it couldn't be opened. */
+} store = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.dir = NULL,
+	.fd = -1,
+	.sum_fd = -1,
+};
+
+/* Pages of index entries, least recently used first out, and the header
+ * & number of entries they were read against. They're dropped whenever
+ * the index is locked, which is the only time this process changes it
+ * and how changes made by others are picked up. Kept under $store.lock. */
+static struct {
+	bool valid;          /* $hdr & $n are read. */
+	HistIndexHeader hdr;
+	uint64_t n;
+	unsigned clock;
+	struct {
+		uint64_t first;  /* index of $entries[0], or UINT64_MAX if unused. */
+		size_t len;
+		unsigned used;
+		HistEntry entries[HIST_PAGE_LEN];
+	} pages[HIST_PAGES];
+} index_cache;
+
+/* A record parsed from the history, and how many lines its text takes
+ * up when laid out $width wide. */
+typedef struct {
+	HistEntry e;
+	History h;
+	int width;
+	int nlines;
+	unsigned used;   /* 0 if the slot is empty. */
+} HistCached;
+
+/* Records parsed by hist_fetch() & by a fetcher thread, started with the
+ * first hist_prefetch(), least recently used first out. The record last
+ * returned by hist_fetch() is pinned, and only it's read without $lock. */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;  /* signalled as records are wanted & parsed, and on quitting. */
+	HistCached recs[HIST_CACHE_MAX];
+	int pinned;              /* index into $recs, or -1. */
+	unsigned clock;
+	HistEntry want[HIST_WANT_MAX];
+	size_t nwant;
+	int want_width;
+	HistEntry fetching;      /* being parsed by the fetcher, if $busy. */
+	bool busy;
+	bool started;
+	bool quit;
+} cache = {
+	.lock    = PTHREAD_MUTEX_INITIALIZER,
+	.changed = PTHREAD_COND_INITIALIZER,
+	.pinned  = -1,
+};
+
+/* A record waiting to be appended by the writer thread. */
+typedef struct {
+	char* rec;
+	size_t len;
+	HistEntry e;
+	const Dictionary* dict;
+	size_t limit;
+} HistJob;
+
+/* Records queued by hist_queue(), appended in order on a writer thread
+ * started with the first one. A job stays queued until it's written. */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed; /* signalled as jobs are queued & written, and on quitting. */
+	HistJob jobs[HIST_QUEUE_MAX];
+	size_t head;
+	size_t njobs;
+	size_t nfailed;         /* appends failed since hist_failed() was last called. */
+	bool started;
+	bool quit;
+} writer = {
+	.lock    = PTHREAD_MUTEX_INITIALIZER,
+	.changed = PTHREAD_COND_INITIALIZER,
+};
+
+/* Open-addressed index of the words of the dictionary records are
+ * written against. */
+static struct {
+	uint64_t hash;   /* Dictionary.hash of the dictionary, or 0. */
+	uint32_t* slots; /* one more than the index of a word, or 0 if empty. */
+	size_t mask;
+} ids;
+
+/* The dictionary of the last record loaded that had one. Records are
+ * decoded under $snap.lock rather than $store.lock, so the writer isn't
+ * held up by them. */
+static struct {
+	pthread_mutex_t lock;
+	uint64_t hash;   /* 0 if none is loaded. */
+	Dictionary dict;
+} snap = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int cmp_names(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int path_in_store(char* buf, size_t sz, const char* name) {
+	return (snprintf(buf, sz, "%s/%s", store.dir, name) >= (int)sz) ? -1 : 0;
+}
+
+static int seg_path(char* buf, size_t sz, uint32_t seg) {
+	char name[32];
+
+	snprintf(name, sizeof(name), "%08"PRIu32".seg", seg);
+	return path_in_store(buf, sz, name);
+}
+
+static int read_header(HistIndexHeader* hdr) {
+	if(pread(store.fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)
+	|| memcmp(hdr->magic, HIST_INDEX_MAGIC, sizeof(hdr->magic)) != 0
+	|| hdr->version != HIST_INDEX_VERSION)
+		return PARSE_ERROR;
+
+	return 0;
+}
+
+static int write_header(const HistIndexHeader* hdr) {
+	return (pwrite(store.fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr)) ? 0 : FILE_ERROR;
+}
+
+/* Return the number of entries in the index, live or not. A partially
+ * written entry at the end isn't counted, and is overwritten next. */
+static uint64_t nentries(void) {
+	struct stat st;
+
+	if(fstat(store.fd, &st) < 0 || (size_t)st.st_size < sizeof(HistIndexHeader))
+		return 0;
+
+	return (st.st_size - sizeof(HistIndexHeader)) / sizeof(HistEntry);
+}
+
+static int read_entry(uint64_t i, HistEntry* e) {
+	const off_t off = sizeof(HistIndexHeader) + i*sizeof(HistEntry);
+	return (pread(store.fd, e, sizeof(*e), off) == sizeof(*e)) ? 0 : FILE_ERROR;
+}
+
+/* Take the index's write lock, first reopening the index if another
+ * process has replaced it since it was opened. */
+static int lock_index(void) {
+	struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+	char path[4096];
+	struct stat st;
+
+	index_cache.valid = false;
+	while(true) {
+		while(fcntl(store.fd, F_SETLKW, &fl) < 0)
+			if(errno != EINTR) return FILE_ERROR;
+
+		if(path_in_store(path, sizeof(path), HIST_INDEX_NAME) < 0 || stat(path, &st) < 0)
+			return FILE_ERROR;
+
+		if(st.st_ino == store.st.st_ino && st.st_dev == store.st.st_dev)
+			return 0;
+
+		close(store.fd);
+		if((store.fd = open(path, O_RDWR)) < 0 || fstat(store.fd, &store.st) < 0)
+			return FILE_ERROR;
+	}
+}
+
+static void unlock_index(void) {
+	struct flock fl = {.l_type = F_UNLCK, .l_whence = SEEK_SET};
+	fcntl(store.fd, F_SETLK, &fl);
+}
+
+/* Read the index's header & number of entries into $index_cache, unless
+ * they still are. */
+static int cache_counts(void) {
+	if(index_cache.valid)
+		return 0;
+
+	if(read_header(&index_cache.hdr) < 0)
+		return FILE_ERROR;
+
+	index_cache.n = nentries();
+	for(int i=0; i<HIST_PAGES; i++)
+		index_cache.pages[i].first = UINT64_MAX;
+
+	index_cache.valid = true;
+	return 0;
+}
+
+/* Store the $i'th entry of the index in $e, reading the page it's on if
+ * it isn't cached. Expects cache_counts() to have been called. */
+static int cached_entry(uint64_t i, HistEntry* e) {
+	const uint64_t first = i - i%HIST_PAGE_LEN;
+	int p = 0;
+
+	for(int j=0; j<HIST_PAGES; j++) {
+		if(index_cache.pages[j].first == first) {
+			p = j;
+			break;
+		}
+
+		if(index_cache.pages[j].used < index_cache.pages[p].used)
+			p = j;
+	}
+
+	if(index_cache.pages[p].first != first) {
+		const size_t len = (index_cache.n - first < HIST_PAGE_LEN)
+			? index_cache.n - first : HIST_PAGE_LEN;
+		const size_t sz = len * sizeof(HistEntry);
+
+		index_cache.pages[p].first = UINT64_MAX;
+		if(pread(store.fd, index_cache.pages[p].entries, sz,
+			sizeof(HistIndexHeader) + first*sizeof(HistEntry)) != (ssize_t)sz)
+			return FILE_ERROR;
+
+		index_cache.pages[p].first = first;
+		index_cache.pages[p].len = len;
+	}
+
+	index_cache.pages[p].used = ++index_cache.clock;
+	*e = index_cache.pages[p].entries[i - first];
+	return 0;
+}
+
+static int put_varint(FILE* fd, uint64_t v) {
+	do {
+		const int b = (v & 0x7f) | ((v > 0x7f) ? 0x80 : 0);
+
+		if(fputc(b, fd) == EOF)
+			return FILE_ERROR;
+	} while(v >>= 7);
+
+	return 0;
+}
+
+static int get_varint(const char** p, const char* end, uint64_t* v) {
+	*v = 0;
+	for(int shift=0; *p < end && shift < 64; shift += 7) {
+		const uint8_t b = *(*p)++;
+
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if(!(b & 0x80)) return 0;
+	}
+
+	return PARSE_ERROR;
+}
+
+static bool is_print_mem(const char* str, size_t len) {
+	for(size_t i=0; i<len; i++)
+		if(!isprint((unsigned char)str[i]))
+			return false;
+
+	return true;
+}
+
+static size_t word_slot(const char* str, size_t len) {
+	return fnv1a(str, len, FNV_OFFSET) & ids.mask;
+}
+
+/* Index the words of $dict, unless they already are. */
+static int index_dict(const Dictionary* dict) {
+	uint32_t* slots;
+	size_t cap = 16;
+
+	if(ids.hash == dict->hash) return 0;
+	if(dict->sz >= UINT32_MAX) return PARSE_ERROR;
+	while(cap < dict->sz*2) cap *= 2;
+	if(!(slots = calloc(cap, sizeof(uint32_t))))
+		return MEM_ERROR;
+
+	free(ids.slots);
+	ids.hash = dict->hash;
+	ids.slots = slots;
+	ids.mask = cap-1;
+	for(size_t i=0; i<dict->sz; i++) {
+		size_t j = word_slot(dict->words[i].str, dict->words[i].len);
+
+		while(ids.slots[j]) j = (j+1) & ids.mask;
+		ids.slots[j] = i+1;
+	}
+
+	return 0;
+}
+
+/* Return the index of $word in $dict, indexed by index_dict(), or -1. */
+static long word_id(const Dictionary* dict, const Word* word) {
+	for(size_t j = word_slot(word->str, word->len); ids.slots[j]; j = (j+1) & ids.mask) {
+		const Word* const w = &dict->words[ids.slots[j]-1];
+
+		if(w->len == word->len && memcmp(w->str, word->str, w->len) == 0)
+			return ids.slots[j]-1;
+	}
+
+	return -1;
+}
+
+/* Return whether $name is that of a dictionary kept for the history,
+ * storing its hash & segment in $hash & $seg. */
+static bool snap_name(const char* name, uint64_t* hash, uint32_t* seg) {
+	int n = 0;
+
+	return sscanf(name, "%16"SCNx64"-%8"SCNu32".dict%n", hash, seg, &n) == 2 && n && !name[n];
+}
+
+static int snap_path(char* buf, size_t sz, uint64_t hash, uint32_t seg) {
+	char name[64];
+
+	snprintf(name, sizeof(name), "%016"PRIx64"-%08"PRIu32".dict", hash, seg);
+	return path_in_store(buf, sz, name);
+}
+
+/* Store the path of the dictionary kept for the history hashing to $hash
+ * in $buf. */
+static int find_snap(uint64_t hash, char* buf, size_t sz) {
+	char** files;
+	int nfiles, ret = -1;
+
+	if((nfiles = dir_contents(store.dir, &files)) < 0)
+		return FILE_ERROR;
+
+	for(int i=0; i<nfiles && ret < 0; i++) {
+		uint64_t h;
+		uint32_t seg;
+
+		if(snap_name(files[i], &h, &seg) && h == hash)
+			ret = path_in_store(buf, sz, files[i]);
+	}
+
+	free_strs(files, nfiles);
+	free(files);
+	return ret;
+}
+
+/* Keep a copy of $dict for the records of segment $seg to index into. */
+static int keep_snap(const Dictionary* dict, uint32_t seg) {
+	char path[4096], old[4096], tmp[4096];
+	FILE* fd;
+	int tfd;
+
+	if(snap_path(path, sizeof(path), dict->hash, seg) < 0)
+		return FILE_ERROR;
+
+	if(access(path, F_OK) == 0)
+		return 0;
+
+	if(find_snap(dict->hash, old, sizeof(old)) == 0)
+		return (rename(old, path) == 0) ? 0 : FILE_ERROR;
+
+	if(snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)
+	|| (tfd = mkstemp(tmp)) < 0)
+		return FILE_ERROR;
+
+	if(fchmod(tfd, 0644) < 0 || !(fd = fdopen(tfd, "w"))) {
+		close(tfd);
+		remove(tmp);
+		return FILE_ERROR;
+	}
+
+	/* there's no source for the copy to go stale against. */
+	if(write_dict_cache(fd, dict, &(struct stat){0}) < 0
+	|| fclose(fd) == EOF || rename(tmp, path) < 0) {
+		remove(tmp);
+		return FILE_ERROR;
+	}
+
+	return 0;
+}
+
+/* Remove the dictionaries no record from segment $oldest_seg on uses. */
+static void drop_snaps(uint32_t oldest_seg) {
+	char path[4096];
+	char** files;
+	int nfiles;
+
+	if((nfiles = dir_contents(store.dir, &files)) < 0)
+		return;
+
+	for(int i=0; i<nfiles; i++) {
+		uint64_t hash;
+		uint32_t seg;
+
+		if(snap_name(files[i], &hash, &seg) && seg < oldest_seg
+		&& path_in_store(path, sizeof(path), files[i]) == 0)
+			remove(path);
+	}
+
+	free_strs(files, nfiles);
+	free(files);
+}
+
+/* Load the dictionary kept for the history hashing to $hash, expecting
+ * $snap.lock to be held. */
+static const Dictionary* load_snap(uint64_t hash) {
+	char path[4096];
+	Dictionary dict;
+	FILE* fd = NULL;
+	int ret;
+
+	if(snap.hash == hash)
+		return &snap.dict;
+
+	/* the writer may be renaming or dropping the file; once open, it can
+	 * be read without holding it up. */
+	pthread_mutex_lock(&store.lock);
+	if(find_snap(hash, path, sizeof(path)) == 0)
+		fd = fopen(path, "r");
+
+	pthread_mutex_unlock(&store.lock);
+	if(!fd)
+		return NULL;
+
+	ret = load_dict_cache(fd, &(struct stat){0}, &dict);
+	fclose(fd);
+	if(ret < 0 || dict.hash != hash)
+		return NULL;
+
+	if(snap.hash) free_dict(&snap.dict);
+	snap.hash = hash;
+	snap.dict = dict;
+	return &snap.dict;
+}
+
+static void put_word(History* h, size_t* pos, Word* w, const char* a, size_t na, const char* b, size_t nb) {
+	w->str = &h->strs[*pos];
+	w->len = na + nb;
+	memcpy(w->str, a, na);
+	if(nb) memcpy(w->str + na, b, nb);
+	w->str[na + nb] = '\0';
+	*pos += na + nb + 1;
+}
+
+/* Only the size of the stat's strings is added to $*pos if $h is NULL. */
+static void put_stat(History* h, size_t* pos, const char* name, const char* fmt, ...) {
+	NameVal* nv;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if(!h) *pos += strlen(name)+1 + vsnprintf(NULL, 0, fmt, ap)+1;
+	else {
+		nv = &h->stats[h->sz_stats++];
+		nv->name = &h->strs[*pos];
+		*pos += sprintf(nv->name, "%s", name) + 1;
+		nv->val = &h->strs[*pos];
+		*pos += vsprintf(nv->val, fmt, ap) + 1;
+	}
+
+	va_end(ap);
+}
+
+/* Decode the stats of the record described by $hdr into $h, as put_stat. */
+static void decode_stats(const HistRecordHeader* hdr, const char* author, const char* source,
+		History* h, size_t* pos) {
+	const HistStats* const st = &hdr->stats;
+
+	put_stat(h, pos, "main-mode", "%s", mode_strs[st->mode]);
+	put_stat(h, pos, "instant-death", "%s", st->ideath ? "on" : "off");
+	put_stat(h, pos, "chars-correct", "%"PRIu32"/%"PRIu32, st->ncorrect, st->ntyped);
+	put_stat(h, pos, "time-elapsed", "%.2fs", st->elapsed_ms / 1000.0);
+	put_stat(h, pos, "wpm", "%.2f", st->wpm);
+	put_stat(h, pos, "accuracy", "%.2f%%", st->acc);
+	put_stat(h, pos, "awl", "%.2f", st->awl);
+	put_stat(h, pos, "seed", "%"PRIu64, st->seed);
+	if(hdr->len_author) put_stat(h, pos, "author", "%.*s", (int)hdr->len_author, author);
+	if(hdr->len_source) put_stat(h, pos, "source", "%.*s", (int)hdr->len_source, source);
+}
+
+/* Decode the words of the record at [$p, $end), described by $hdr, into
+ * $h; only the size of their strings is added to $*pos if $h is NULL. */
+static int decode_words(const char* p, const char* end, const HistRecordHeader* hdr,
+		const Dictionary* dict, History* h, size_t* pos) {
+	for(uint32_t i=0; i<hdr->nwords; i++) {
+		const char* word, *rest = NULL;
+		uint64_t v, prefix, n = 0;
+		size_t len;
+
+		if(get_varint(&p, end, &v) < 0)
+			return PARSE_ERROR;
+
+		if(v & 1) {
+			len = v >> 1;
+			if(len > (size_t)(end - p) || len > INT_MAX || !is_print_mem(p, len))
+				return PARSE_ERROR;
+
+			word = p;
+			p += len;
+		}
+
+		else {
+			if(!dict || (v >> 1) >= dict->sz)
+				return PARSE_ERROR;
+
+			word = dict->words[v >> 1].str;
+			len = dict->words[v >> 1].len;
+		}
+
+		if(h) put_word(h, pos, &h->text[i], word, len, NULL, 0);
+		else *pos += len+1;
+
+		if(i >= hdr->nmatches) continue;
+		if(get_varint(&p, end, &prefix) < 0)
+			return PARSE_ERROR;
+
+		if(prefix == 0) prefix = len;
+		else if(--prefix > len || get_varint(&p, end, &n) < 0
+		|| n > (size_t)(end - p) || n > INT_MAX - prefix || !is_print_mem(p, n))
+			return PARSE_ERROR;
+
+		else {
+			rest = p;
+			p += n;
+		}
+
+		if(h) put_word(h, pos, &h->matches[i], word, prefix, rest, n);
+		else *pos += prefix + n + 1;
+	}
+
+	return (p == end) ? 0 : PARSE_ERROR;
+}
+
+/* Decode the binary record $rec of $len bytes into $h, expecting
+ * $snap.lock to be held. */
+static int decode_record(const char* rec, size_t len, History* h) {
+	const char* p = rec + sizeof(HistRecordHeader);
+	const char* const end = rec + len;
+	const Dictionary* dict = NULL;
+	const char* author, *source;
+	HistRecordHeader hdr;
+	size_t sz = 0, pos = 0;
+
+	if(len < sizeof(hdr)) return PARSE_ERROR;
+	memcpy(&hdr, rec, sizeof(hdr));
+	if(hdr.version != HIST_REC_VERSION || hdr.stats.mode >= NUM_MODES
+	|| hdr.nmatches > hdr.nwords || hdr.nwords > INT_MAX
+	|| (size_t)(end - p) < (size_t)hdr.len_author + hdr.len_source)
+		return PARSE_ERROR;
+
+	author = p;
+	source = author + hdr.len_author;
+	p = source + hdr.len_source;
+	if(!is_print_mem(author, hdr.len_author) || !is_print_mem(source, hdr.len_source))
+		return PARSE_ERROR;
+
+	if(hdr.dict && !(dict = load_snap(hdr.dict)))
+		return FILE_ERROR;
+
+	if(decode_words(p, end, &hdr, dict, NULL, &sz) < 0)
+		return PARSE_ERROR;
+	decode_stats(&hdr, author, source, NULL, &sz);
+
+	*h = (History){0};
+	h->stats = calloc(HIST_REC_STATS+1, sizeof(NameVal));
+	h->text = calloc(hdr.nwords ? hdr.nwords : 1, sizeof(Word));
+	h->matches = calloc(hdr.nmatches ? hdr.nmatches : 1, sizeof(Word));
+	h->strs = malloc(sz);
+	if(!h->stats || !h->text || !h->matches || !h->strs) {
+		free_hist(h);
+		return MEM_ERROR;
+	}
+
+	decode_stats(&hdr, author, source, h, &pos);
+
+	h->nwords = hdr.nwords;
+	h->nmatches = hdr.nmatches;
+	decode_words(p, end, &hdr, dict, h, &pos);
+	return 0;
+}
+
+/* Write the record of $h, loaded from a text record, to $fd; $s is filled
+ * in with its stats. */
+static int convert_legacy(FILE* fd, const History* h, HistStats* s) {
+	const char* author = NULL, *source = NULL;
+	int ret;
+
+	*s = (HistStats){0};
+	for(int i=0; i<h->sz_stats; i++) {
+		const char* const name = h->stats[i].name;
+		const char* const val = h->stats[i].val;
+		double ms;
+
+		if(streq(name, "main-mode")) {
+			for(int m=0; m<NUM_MODES; m++)
+				if(streq(val, mode_strs[m])) s->mode = m;
+		}
+
+		else if(streq(name, "instant-death")) s->ideath = streq(val, "on");
+		else if(streq(name, "chars-correct"))
+			sscanf(val, "%"SCNu32"/%"SCNu32, &s->ncorrect, &s->ntyped);
+		else if(streq(name, "time-elapsed") && sscanf(val, "%lf", &ms) == 1)
+			s->elapsed_ms = ms * 1000 + 0.5;
+		else if(streq(name, "wpm")) s->wpm = strtod(val, NULL);
+		else if(streq(name, "accuracy")) s->acc = strtod(val, NULL);
+		else if(streq(name, "awl")) s->awl = strtod(val, NULL);
+		else if(streq(name, "seed")) s->seed = strtoull(val, NULL, 10);
+		else if(streq(name, "author")) author = val;
+		else if(streq(name, "source")) source = val;
+	}
+
+	if((ret = hist_write_header(fd, s, author, source, h->nwords, h->nmatches, NULL)) < 0)
+		return ret;
+
+	for(int i=0; i<h->nwords; i++)
+		hist_write_word(fd, &h->text[i], (i < h->nmatches) ? &h->matches[i] : NULL, NULL);
+
+	return ferror(fd) ? FILE_ERROR : 0;
+}
+
+/* Return the local date of the time $ms, in milliseconds since the
+ * epoch, as days since the epoch. */
+static int32_t local_day(int64_t ms) {
+	const time_t t = ms / 1000;
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+
+	/* days_from_civil(), from Howard Hinnant's date algorithms. */
+	const int y = tm.tm_year + 1900 - (tm.tm_mon < 2);
+	const int era = ((y >= 0) ? y : y-399) / 400;
+	const int yoe = y - era*400;
+	const int doy = (153*((tm.tm_mon + 10) % 12) + 2)/5 + tm.tm_mday-1;
+	const int doe = yoe*365 + yoe/4 - yoe/100 + doy;
+	return era*146097 + doe - 719468;
+}
+
+/* Add the test of $e, with the stats $s if its record has them, to $sum. */
+static void add_to_summary(HistSummary* sum, const HistEntry* e, const HistStats* s) {
+	const int32_t day = local_day(e->time);
+	HistDay* const d = &sum->days[(uint32_t)day % HIST_DAYS];
+
+	if(sum->ntests++ == 0 || e->time < sum->first_time)
+		sum->first_time = e->time;
+
+	if(s) {
+		sum->elapsed_ms += s->elapsed_ms;
+		sum->ntyped += s->ntyped;
+		sum->ncorrect += s->ncorrect;
+	}
+
+	if(e->mode < NUM_MODES) {
+		HistModeSum* const m = &sum->modes[e->mode];
+
+		if(m->ntests++ == 0 || e->wpm > m->best_wpm) {
+			m->best_wpm = e->wpm;
+			m->best_time = e->time;
+		}
+
+		m->sum_wpm += e->wpm;
+		m->sum_acc += e->acc;
+	}
+
+	/* the slot may hold a day since gone, or be newer than the test. */
+	if(d->ntests && d->day > day) return;
+	if(d->day != day) *d = (HistDay){.day = day};
+	d->ntests++;
+	d->sum_wpm += e->wpm;
+	d->sum_acc += e->acc;
+}
+
+static int read_summary(HistSummary* sum) {
+	HistSummaryHeader hdr;
+
+	if(pread(store.sum_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| memcmp(hdr.magic, HIST_SUM_MAGIC, sizeof(hdr.magic)) != 0
+	|| hdr.version != HIST_SUM_VERSION
+	|| pread(store.sum_fd, sum, sizeof(*sum), sizeof(hdr)) != sizeof(*sum))
+		return PARSE_ERROR;
+
+	return 0;
+}
+
+static int write_summary(const HistSummary* sum) {
+	HistSummaryHeader hdr = {.version = HIST_SUM_VERSION};
+
+	memcpy(hdr.magic, HIST_SUM_MAGIC, sizeof(hdr.magic));
+	if(pwrite(store.sum_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	|| pwrite(store.sum_fd, sum, sizeof(*sum), sizeof(hdr)) != sizeof(*sum))
+		return FILE_ERROR;
+
+	return 0;
+}
+
+/* Add the test of $e to the summary; see add_to_summary(). Expects the
+ * index to be locked. */
+static void summarize_locked(const HistEntry* e, const HistStats* s) {
+	HistSummary sum;
+
+	if(store.sum_fd < 0 || read_summary(&sum) < 0)
+		return;
+
+	add_to_summary(&sum, e, s);
+	write_summary(&sum);
+}
+
+/* Add the tests of entries $from up to, but excluding, $to to $sum. Their
+ * segments are expected to still be there. */
+static void summarize_entries(HistSummary* sum, uint64_t from, uint64_t to) {
+	uint32_t seg = 0;
+	int sfd = -1;
+
+	for(uint64_t i=from; i<to; i++) {
+		char path[4096];
+		HistRecordHeader rhdr;
+		HistEntry e;
+
+		if(read_entry(i, &e) < 0)
+			continue;
+
+		if(sfd < 0 || e.seg != seg) {
+			if(sfd >= 0) close(sfd);
+			seg = e.seg;
+			sfd = (seg_path(path, sizeof(path), seg) == 0) ? open(path, O_RDONLY) : -1;
+		}
+
+		/* records appended before they were binary have no stats to add. */
+		const bool has_stats = sfd >= 0 && e.len >= sizeof(rhdr)
+			&& pread(sfd, &rhdr, sizeof(rhdr), e.off + sizeof(uint32_t)) == sizeof(rhdr)
+			&& memcmp(rhdr.magic, HIST_REC_MAGIC, sizeof(rhdr.magic)) == 0;
+		add_to_summary(sum, &e, has_stats ? &rhdr.stats : NULL);
+	}
+
+	if(sfd >= 0) close(sfd);
+}
+
+/* Summarize the records of the index, described by $hdr, from those
+ * already pruned on. Expects the index to be locked. */
+static int rebuild_summary(const HistIndexHeader* hdr) {
+	HistSummary sum = hdr->pruned;
+
+	summarize_entries(&sum, hdr->start, nentries());
+	return write_summary(&sum);
+}
+
+/* Open the summary, starting it afresh if the index is new; otherwise it's
+ * rebuilt if it's missing or unreadable. Expects the index to be locked. */
+static int open_summary(const HistIndexHeader* hdr, bool fresh) {
+	char path[4096];
+	HistSummary sum;
+
+	if(path_in_store(path, sizeof(path), HIST_SUM_NAME) < 0
+	|| (store.sum_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+		return FILE_ERROR;
+
+	if(fresh) return write_summary(&(HistSummary){0});
+	if(read_summary(&sum) == 0) return 0;
+	return rebuild_summary(hdr);
+}
+
+/* Rewrite the index as $hdr followed by its $nlive entries from $off on,
+ * replacing it atomically. */
+static int rewrite_index(HistIndexHeader* hdr, off_t off, uint64_t nlive) {
+	const size_t sz = nlive * sizeof(HistEntry);
+	HistIndexHeader nhdr = *hdr;
+	char path[4096], tmp[4096];
+	char* entries;
+	int tfd;
+
+	if(path_in_store(path, sizeof(path), HIST_INDEX_NAME) < 0
+	|| snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return FILE_ERROR;
+
+	if(!(entries = malloc(sz ? sz : 1)))
+		return MEM_ERROR;
+
+	if(pread(store.fd, entries, sz, off) != (ssize_t)sz || (tfd = mkstemp(tmp)) < 0) {
+		free(entries);
+		return FILE_ERROR;
+	}
+
+	/* lock the new index before others can open it; closing the old one
+	 * then lets whoever waits on it find it replaced. */
+	nhdr.start = 0;
+	if(fcntl(tfd, F_SETLK, &(struct flock){.l_type = F_WRLCK, .l_whence = SEEK_SET}) < 0
+	|| fchmod(tfd, 0644) < 0
+	|| write(tfd, &nhdr, sizeof(nhdr)) != sizeof(nhdr)
+	|| write(tfd, entries, sz) != (ssize_t)sz
+	|| rename(tmp, path) < 0) {
+		free(entries);
+		close(tfd);
+		remove(tmp);
+		return FILE_ERROR;
+	}
+
+	free(entries);
+	close(store.fd);
+	store.fd = tfd;
+	fstat(store.fd, &store.st);
+	*hdr = nhdr;
+	return 0;
+}
+
+/* Rewrite an index from before it kept $pruned, storing its new header in
+ * $hdr; the tests it had already pruned are left out of $pruned. Expects
+ * the index to be locked. */
+static int upgrade_index(HistIndexHeader* hdr) {
+	HistIndexHeaderV1 old;
+	struct stat st;
+	uint64_t n;
+
+	if(pread(store.fd, &old, sizeof(old), 0) != sizeof(old)
+	|| memcmp(old.magic, HIST_INDEX_MAGIC, sizeof(old.magic)) != 0
+	|| old.version != 1 || fstat(store.fd, &st) < 0
+	|| (n = (st.st_size - sizeof(old)) / sizeof(HistEntry)) < old.start)
+		return PARSE_ERROR;
+
+	*hdr = (HistIndexHeader){.start = old.start, .oldest_seg = old.oldest_seg, .cur_seg = old.cur_seg};
+	memcpy(hdr->magic, HIST_INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->version = HIST_INDEX_VERSION;
+	return rewrite_index(hdr, sizeof(old) + old.start*sizeof(HistEntry), n - old.start);
+}
+
+/* Drop all but the newest $limit entries, summarizing their tests into
+ * $hdr->pruned & removing the segments no live entry is in. Expects the
+ * index to be locked. */
+static int prune_locked(HistIndexHeader* hdr, size_t limit) {
+	const uint64_t n = nentries();
+	uint32_t first_seg = hdr->cur_seg;
+	char path[4096];
+	HistEntry e;
+
+	if(n - hdr->start > limit) {
+		summarize_entries(&hdr->pruned, hdr->start, n - limit);
+		hdr->start = n - limit;
+	}
+
+	if(hdr->start < n) {
+		if(read_entry(hdr->start, &e) < 0)
+			return FILE_ERROR;
+
+		first_seg = e.seg;
+	}
+
+	if(hdr->oldest_seg < first_seg) {
+		for(; hdr->oldest_seg < first_seg; hdr->oldest_seg++)
+			if(seg_path(path, sizeof(path), hdr->oldest_seg) == 0)
+				remove(path);
+
+		drop_snaps(hdr->oldest_seg);
+	}
+
+	if(hdr->start >= HIST_COMPACT_MIN && hdr->start*2 >= n)
+		return rewrite_index(hdr, sizeof(*hdr) + hdr->start*sizeof(HistEntry), n - hdr->start);
+
+	return write_header(hdr);
+}
+
+/* Append the record $rec of $len bytes, described by $e, to the history
+ * and then drop all but the newest $limit records. $e's location is
+ * filled in; $dict is the dictionary the record's words index into, if
+ * any. Expects the index to be locked. */
+static int append_locked(const char* rec, uint32_t len, HistEntry* e,
+		const Dictionary* dict, size_t limit) {
+	const uint64_t n = nentries();
+	const HistStats* stats = NULL;
+	HistRecordHeader rhdr;
+	HistIndexHeader hdr;
+	char path[4096];
+	struct stat st;
+	int sfd;
+
+	if(read_header(&hdr) < 0)
+		return PARSE_ERROR;
+
+	if(seg_path(path, sizeof(path), hdr.cur_seg) < 0
+	|| (sfd = open(path, O_WRONLY | O_CREAT, 0644)) < 0)
+		return FILE_ERROR;
+
+	if(fstat(sfd, &st) < 0) {
+		close(sfd);
+		return FILE_ERROR;
+	}
+
+	if(st.st_size >= HIST_SEG_MAX) {
+		close(sfd);
+		hdr.cur_seg++;
+		st.st_size = 0;
+		if(seg_path(path, sizeof(path), hdr.cur_seg) < 0
+		|| (sfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+			return FILE_ERROR;
+	}
+
+	/* the dictionary has to be there before any record using it is. */
+	if(len >= sizeof(rhdr) && memcmp(rec, HIST_REC_MAGIC, sizeof(rhdr.magic)) == 0) {
+		memcpy(&rhdr, rec, sizeof(rhdr));
+		stats = &rhdr.stats;
+		if(rhdr.dict && (!dict || dict->hash != rhdr.dict || keep_snap(dict, hdr.cur_seg) < 0)) {
+			close(sfd);
+			return FILE_ERROR;
+		}
+	}
+
+	e->seg = hdr.cur_seg;
+	e->off = st.st_size;
+	e->len = len;
+	if(pwrite(sfd, &len, sizeof(len), e->off) != sizeof(len)
+	|| pwrite(sfd, rec, len, e->off + sizeof(len)) != (ssize_t)len) {
+		close(sfd);
+		return FILE_ERROR;
+	}
+
+	close(sfd);
+
+	/* the record is only part of the history once its entry is written. */
+	if(pwrite(store.fd, e, sizeof(*e), sizeof(hdr) + n*sizeof(*e)) != sizeof(*e)
+	|| ftruncate(store.fd, sizeof(hdr) + (n+1)*sizeof(*e)) < 0)
+		return FILE_ERROR;
+
+	summarize_locked(e, stats);
+	return prune_locked(&hdr, limit);
+}
+
+/* Return the time in the name of a history file written before the
+ * history was kept in segments, or -1 if $name isn't one. */
+static int64_t legacy_time(const char* name) {
+	struct tm t = {0};
+	int ms, n = 0;
+
+	if(sscanf(name, "%4d-%2d-%2d-%2d:%2d:%2d,%3d%n", &t.tm_year, &t.tm_mon,
+		&t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec, &ms, &n) != 7 || name[n])
+		return -1;
+
+	t.tm_year -= 1900;
+	t.tm_mon -= 1;
+	t.tm_isdst = -1;
+	return (int64_t)mktime(&t)*1000 + ms;
+}
+
+/* Import the one-file-per-test history files in $dir, oldest first,
+ * converting each to a record & removing it once it's in the index.
+ * Expects the index to be locked. */
+static int import_legacy(char* dir) {
+	char** files;
+	char path[4096];
+	int nfiles;
+
+	if((nfiles = dir_contents(dir, &files)) < 0)
+		return FILE_ERROR;
+
+	qsort(files, nfiles, sizeof(char*), cmp_names);
+	for(int i=0; i<nfiles; i++) {
+		HistEntry e = {.time = legacy_time(files[i])};
+		HistStats stats;
+		History h;
+		char* text, *rec;
+		size_t len, sz_rec;
+		FILE* fd, *mem;
+
+		if(e.time < 0 || snprintf(path, sizeof(path), "%s/%s", dir, files[i]) >= (int)sizeof(path)
+		|| !(fd = fopen(path, "r")))
+			continue;
+
+		if(map_file(fd, &text, &len) < 0) {
+			fclose(fd);
+			continue;
+		}
+
+		if(load_hist(text, len, &h) == 0) {
+			if((mem = open_memstream(&rec, &sz_rec))) {
+				const int ret = convert_legacy(mem, &h, &stats);
+
+				if(fclose(mem) == 0 && ret == 0 && sz_rec <= UINT32_MAX) {
+					e.wpm = stats.wpm;
+					e.acc = stats.acc;
+					e.mode = stats.mode;
+					if(append_locked(rec, sz_rec, &e, NULL, SIZE_MAX) == 0)
+						remove(path);
+				}
+
+				free(rec);
+			}
+
+			free_hist(&h);
+		}
+
+		unmap_file(text, len);
+		fclose(fd);
+	}
+
+	free_strs(files, nfiles);
+	free(files);
+	return 0;
+}
+
+/* Append the record $rec of $len bytes to the history; see hist_queue(). */
+static int append_record(const char* rec, size_t len, HistEntry* e,
+		const Dictionary* dict, size_t limit) {
+	int ret = FILE_ERROR;
+
+	pthread_mutex_lock(&store.lock);
+	if(store.fd >= 0 && lock_index() == 0) {
+		ret = append_locked(rec, len, e, dict, limit);
+		unlock_index();
+	}
+
+	pthread_mutex_unlock(&store.lock);
+	return ret;
+}
+
+static void* run_writer(void* arg) {
+	(void)arg;
+	pthread_mutex_lock(&writer.lock);
+	while(true) {
+		HistJob* job;
+		int ret;
+
+		while(!writer.njobs && !writer.quit)
+			pthread_cond_wait(&writer.changed, &writer.lock);
+
+		if(!writer.njobs) break;
+
+		/* the head isn't touched by hist_queue() until it's dequeued. */
+		job = &writer.jobs[writer.head];
+		pthread_mutex_unlock(&writer.lock);
+		ret = append_record(job->rec, job->len, &job->e, job->dict, job->limit);
+		free(job->rec);
+
+		pthread_mutex_lock(&writer.lock);
+		if(ret < 0) writer.nfailed++;
+		writer.head = (writer.head + 1) % HIST_QUEUE_MAX;
+		writer.njobs--;
+		pthread_cond_broadcast(&writer.changed);
+	}
+
+	pthread_mutex_unlock(&writer.lock);
+	return NULL;
+}
+
+static bool same_entry(const HistEntry* a, const HistEntry* b) {
+	return a->seg == b->seg && a->off == b->off && a->len == b->len && a->time == b->time;
+}
+
+/* Return the slot of $cache.recs holding the record of $e, or -1.
+ * Expects $cache.lock to be held. */
+static int find_cached(const HistEntry* e) {
+	for(int i=0; i<HIST_CACHE_MAX; i++)
+		if(cache.recs[i].used && same_entry(&cache.recs[i].e, e))
+			return i;
+
+	return -1;
+}
+
+/* Parse the record of $e into $c, laid out $width wide. */
+static int parse_cached(const HistEntry* e, int width, HistCached* c) {
+	int ret;
+
+	if((ret = hist_load(e, &c->h)) < 0)
+		return ret;
+
+	c->e = *e;
+	c->width = width;
+	c->nlines = nlines_text(c->h.text, c->h.matches, c->h.nwords, c->h.nmatches, width);
+	return 0;
+}
+
+/* Move $c into the least recently used slot of $cache.recs that isn't
+ * pinned, and return the slot. Expects $cache.lock to be held. */
+static int put_cached(const HistCached* c) {
+	int slot = -1;
+
+	for(int i=0; i<HIST_CACHE_MAX; i++)
+		if(i != cache.pinned && (slot < 0 || cache.recs[i].used < cache.recs[slot].used))
+			slot = i;
+
+	if(cache.recs[slot].used)
+		free_hist(&cache.recs[slot].h);
+
+	cache.recs[slot] = *c;
+	cache.recs[slot].used = ++cache.clock;
+	return slot;
+}
+
+static void* run_fetcher(void* arg) {
+	(void)arg;
+	pthread_mutex_lock(&cache.lock);
+	while(true) {
+		HistCached c;
+		int width, ret;
+
+		while(!cache.nwant && !cache.quit)
+			pthread_cond_wait(&cache.changed, &cache.lock);
+
+		if(cache.quit) break;
+
+		cache.fetching = cache.want[0];
+		width = cache.want_width;
+		memmove(cache.want, cache.want+1, --cache.nwant * sizeof(HistEntry));
+		if(find_cached(&cache.fetching) >= 0)
+			continue;
+
+		cache.busy = true;
+		pthread_mutex_unlock(&cache.lock);
+		ret = parse_cached(&cache.fetching, width, &c);
+
+		/* hist_fetch() may have parsed it meanwhile. */
+		pthread_mutex_lock(&cache.lock);
+		if(ret == 0 && find_cached(&c.e) < 0) put_cached(&c);
+		else if(ret == 0) free_hist(&c.h);
+
+		cache.busy = false;
+		pthread_cond_broadcast(&cache.changed);
+	}
+
+	pthread_mutex_unlock(&cache.lock);
+	return NULL;
+}
+
+/* Open the history kept in the directory $dir, creating it there if
+ * there is none; history files from before it was kept this way are
+ * imported into it. */
+int hist_open(const char* dir) {
+	char path[4096];
+	HistIndexHeader hdr;
+	bool fresh;
+	int ret = 0;
+
+	if(!(store.dir = strdup(dir)))
+		return MEM_ERROR;
+
+	pthread_mutex_lock(&store.lock);
+	if(path_in_store(path, sizeof(path), HIST_INDEX_NAME) < 0
+	|| (store.fd = open(path, O_RDWR | O_CREAT, 0644)) < 0
+	|| fstat(store.fd, &store.st) < 0
+	|| lock_index() < 0) {
+		if(store.fd >= 0) close(store.fd);
+		store.fd = -1;
+		pthread_mutex_unlock(&store.lock);
+		return FILE_ERROR;
+	}
+
+	if(read_header(&hdr) == 0 || upgrade_index(&hdr) == 0)
+		fresh = false;
+
+	else if((fresh = nentries() == 0)) {
+		hdr = (HistIndexHeader){.start = 0, .oldest_seg = 0, .cur_seg = 0};
+		memcpy(hdr.magic, HIST_INDEX_MAGIC, sizeof(hdr.magic));
+		hdr.version = HIST_INDEX_VERSION;
+		ret = write_header(&hdr);
+	}
+
+	else ret = PARSE_ERROR;
+
+	/* the history still works without a summary, only trends don't. */
+	if(ret == 0 && open_summary(&hdr, fresh) < 0 && store.sum_fd >= 0) {
+		close(store.sum_fd);
+		store.sum_fd = -1;
+	}
+
+	if(ret == 0 && fresh)
+		ret = import_legacy(store.dir);
+
+	/* with $XDG_STATE_HOME set, older versions kept their history-files
+	 * one directory further down. */
+	if(ret == 0 && path_in_store(path, sizeof(path), DIR_HISTORY) == 0
+	&& import_legacy(path) == 0)
+		rmdir(path);
+
+	unlock_index();
+	if(ret < 0) {
+		close(store.fd);
+		store.fd = -1;
+	}
+
+	pthread_mutex_unlock(&store.lock);
+	return ret;
+}
+
+/* Return the number of records in the history. */
+size_t hist_count(void) {
+	size_t count = 0;
+
+	pthread_mutex_lock(&store.lock);
+	if(store.fd >= 0 && cache_counts() == 0 && index_cache.n > index_cache.hdr.start)
+		count = index_cache.n - index_cache.hdr.start;
+
+	pthread_mutex_unlock(&store.lock);
+	return count;
+}
+
+/* Store the entry of the $i'th newest record in $e. */
+int hist_entry(size_t i, HistEntry* e) {
+	uint64_t n;
+	int ret = -1;
+
+	pthread_mutex_lock(&store.lock);
+	if(store.fd < 0 || cache_counts() < 0)
+		ret = FILE_ERROR;
+	else if((n = index_cache.n) > index_cache.hdr.start && i < n - index_cache.hdr.start)
+		ret = cached_entry(n-1 - i, e);
+
+	pthread_mutex_unlock(&store.lock);
+	return ret;
+}
+
+/* Queue the record $rec of $len bytes to be appended to the history by
+ * the writer thread, with the stats in $e, keeping only the newest $limit
+ * records; $rec is freed once it's written. $dict is the dictionary the
+ * record was written against, if any, and must outlive the write; see
+ * hist_sync(). Blocks while the queue is full. */
+int hist_queue(char* rec, size_t len, const HistEntry* e, const Dictionary* dict, size_t limit) {
+	HistJob* job;
+	int ret;
+
+	if(len > UINT32_MAX) {
+		free(rec);
+		return PARSE_ERROR;
+	}
+
+	pthread_mutex_lock(&writer.lock);
+	if(!writer.started && !writer.quit)
+		writer.started = pthread_create(&writer.thread, NULL, run_writer, NULL) == 0;
+
+	/* without a writer, the record is written here. */
+	if(!writer.started) {
+		HistEntry copy = *e;
+
+		pthread_mutex_unlock(&writer.lock);
+		ret = append_record(rec, len, &copy, dict, limit);
+		free(rec);
+		return ret;
+	}
+
+	while(writer.njobs == HIST_QUEUE_MAX)
+		pthread_cond_wait(&writer.changed, &writer.lock);
+
+	job = &writer.jobs[(writer.head + writer.njobs) % HIST_QUEUE_MAX];
+	*job = (HistJob){.rec = rec, .len = len, .e = *e, .dict = dict, .limit = limit};
+	writer.njobs++;
+	pthread_cond_broadcast(&writer.changed);
+	pthread_mutex_unlock(&writer.lock);
+	return 0;
+}
+
+/* Wait for every queued record to be written. */
+void hist_sync(void) {
+	pthread_mutex_lock(&writer.lock);
+	while(writer.njobs)
+		pthread_cond_wait(&writer.changed, &writer.lock);
+
+	pthread_mutex_unlock(&writer.lock);
+}
+
+/* Return the number of queued records that failed to be written since
+ * the last call. */
+size_t hist_failed(void) {
+	size_t nfailed;
+
+	pthread_mutex_lock(&writer.lock);
+	nfailed = writer.nfailed;
+	writer.nfailed = 0;
+	pthread_mutex_unlock(&writer.lock);
+	return nfailed;
+}
+
+/* Write every queued record and stop the writer & fetcher threads;
+ * records queued after are written as they're queued. */
+void hist_close(void) {
+	pthread_mutex_lock(&writer.lock);
+	writer.quit = true;
+	pthread_cond_broadcast(&writer.changed);
+	pthread_mutex_unlock(&writer.lock);
+	if(writer.started) {
+		pthread_join(writer.thread, NULL);
+		writer.started = false;
+	}
+
+	pthread_mutex_lock(&cache.lock);
+	cache.quit = true;
+	pthread_cond_broadcast(&cache.changed);
+	pthread_mutex_unlock(&cache.lock);
+	if(cache.started) {
+		pthread_join(cache.thread, NULL);
+		cache.started = false;
+	}
+
+	for(int i=0; i<HIST_CACHE_MAX; i++)
+		if(cache.recs[i].used) free_hist(&cache.recs[i].h);
+
+	memset(cache.recs, 0, sizeof(cache.recs));
+	cache.pinned = -1;
+}
+
+/* Store the summary of every test added to the history in $sum. */
+int hist_summary(HistSummary* sum) {
+	int ret = FILE_ERROR;
+
+	pthread_mutex_lock(&store.lock);
+	if(store.fd >= 0 && store.sum_fd >= 0 && lock_index() == 0) {
+		ret = read_summary(sum);
+		unlock_index();
+	}
+
+	pthread_mutex_unlock(&store.lock);
+	return ret;
+}
+
+/* Format the date of $day, in days since the epoch. */
+void hist_day_str(int32_t day, char* buf, size_t sz) {
+	const time_t t = (time_t)day * 86400;
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, sz, "%Y-%m-%d", &tm);
+}
+
+/* Drop all but the newest $limit records. */
+int hist_prune(size_t limit) {
+	HistIndexHeader hdr;
+	int ret = FILE_ERROR;
+
+	pthread_mutex_lock(&store.lock);
+	if(store.fd >= 0 && lock_index() == 0) {
+		if((ret = read_header(&hdr)) == 0)
+			ret = prune_locked(&hdr, limit);
+
+		unlock_index();
+	}
+
+	pthread_mutex_unlock(&store.lock);
+	return ret;
+}
+
+/* Read the record described by $e into $*rec, which should be freed by
+ * the caller; its length is stored in $*len. Segments are only appended
+ * to or removed whole, so $store.lock is held just while opening one. */
+int hist_read(const HistEntry* e, char** rec, size_t* len) {
+	char path[4096];
+	uint32_t prefix;
+	int fd = -1;
+
+	pthread_mutex_lock(&store.lock);
+	if(seg_path(path, sizeof(path), e->seg) == 0)
+		fd = open(path, O_RDONLY);
+
+	pthread_mutex_unlock(&store.lock);
+	if(fd < 0)
+		return FILE_ERROR;
+
+	if(pread(fd, &prefix, sizeof(prefix), e->off) != sizeof(prefix) || prefix != e->len) {
+		close(fd);
+		return PARSE_ERROR;
+	}
+
+	if(!(*rec = malloc(e->len ? e->len : 1))) {
+		close(fd);
+		return MEM_ERROR;
+	}
+
+	if(pread(fd, *rec, e->len, e->off + sizeof(prefix)) != (ssize_t)e->len) {
+		free(*rec);
+		close(fd);
+		return FILE_ERROR;
+	}
+
+	close(fd);
+	*len = e->len;
+	return 0;
+}
+
+/* Parse the record described by $e into $h. */
+int hist_load(const HistEntry* e, History* h) {
+	char* rec;
+	size_t len;
+	int ret;
+
+	if((ret = hist_read(e, &rec, &len)) < 0)
+		return ret;
+
+	/* records appended before they were binary are still text. */
+	if(len >= 4 && memcmp(rec, HIST_REC_MAGIC, 4) == 0) {
+		pthread_mutex_lock(&snap.lock);
+		ret = decode_record(rec, len, h);
+		pthread_mutex_unlock(&snap.lock);
+	} else ret = load_hist(rec, len, h);
+
+	free(rec);
+	return ret;
+}
+
+/* Have the records of $es parsed in the background, in order, each laid
+ * out $width wide, in place of any still waiting to be. */
+void hist_prefetch(const HistEntry* es, size_t n, int width) {
+	pthread_mutex_lock(&cache.lock);
+	if(!cache.started && !cache.quit)
+		cache.started = pthread_create(&cache.thread, NULL, run_fetcher, NULL) == 0;
+
+	cache.nwant = 0;
+	for(size_t i=0; i<n && cache.nwant < HIST_WANT_MAX; i++)
+		if(find_cached(&es[i]) < 0)
+			cache.want[cache.nwant++] = es[i];
+
+	cache.want_width = width;
+	pthread_cond_broadcast(&cache.changed);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/* Store the parsed record of $e in $*h and the number of lines its text
+ * takes up laid out $width wide in $*nlines. It's parsed here only if it
+ * isn't cached or being parsed in the background. $*h stays valid until
+ * the next call. */
+int hist_fetch(const HistEntry* e, int width, const History** h, int* nlines) {
+	HistCached c;
+	int slot, ret;
+
+	pthread_mutex_lock(&cache.lock);
+	while(cache.busy && same_entry(&cache.fetching, e))
+		pthread_cond_wait(&cache.changed, &cache.lock);
+
+	if((slot = find_cached(e)) < 0) {
+		pthread_mutex_unlock(&cache.lock);
+		if((ret = parse_cached(e, width, &c)) < 0)
+			return ret;
+
+		pthread_mutex_lock(&cache.lock);
+		if((slot = find_cached(e)) < 0) slot = put_cached(&c);
+		else free_hist(&c.h);
+	}
+
+	if(cache.recs[slot].width != width) {
+		HistCached* const r = &cache.recs[slot];
+		r->nlines = nlines_text(r->h.text, r->h.matches, r->h.nwords, r->h.nmatches, width);
+		r->width = width;
+	}
+
+	cache.pinned = slot;
+	cache.recs[slot].used = ++cache.clock;
+	*h = &cache.recs[slot].h;
+	*nlines = cache.recs[slot].nlines;
+	pthread_mutex_unlock(&cache.lock);
+	return 0;
+}
+
+/* Write the head of a history record to $fd: the test's $stats, its
+ * $author & $source (either may be NULL), and the number of words in its
+ * text & of those typed. Words of the text found in $dict, if not NULL,
+ * are written as indexes into it. */
+int hist_write_header(FILE* fd, const HistStats* stats, const char* author,
+		const char* source, size_t nwords, size_t nmatches, const Dictionary* dict) {
+	HistRecordHeader hdr = {
+		.version = HIST_REC_VERSION,
+		.stats = *stats,
+		.nwords = nwords,
+		.nmatches = nmatches,
+		.len_author = (author) ? strnlen(author, UINT16_MAX) : 0,
+		.len_source = (source) ? strnlen(source, UINT16_MAX) : 0,
+	};
+
+	if(nwords > INT_MAX || nmatches > nwords)
+		return PARSE_ERROR;
+
+	memcpy(hdr.magic, HIST_REC_MAGIC, sizeof(hdr.magic));
+	if(dict && index_dict(dict) == 0)
+		hdr.dict = dict->hash;
+
+	if(fwrite(&hdr, sizeof(hdr), 1, fd) != 1
+	|| (author && fwrite(author, 1, hdr.len_author, fd) != hdr.len_author)
+	|| (source && fwrite(source, 1, hdr.len_source, fd) != hdr.len_source))
+		return FILE_ERROR;
+
+	return 0;
+}
+
+/* Write a word of the text to $fd, followed by what was typed for it,
+ * $match, if it's not NULL. $dict is as given to hist_write_header(). */
+int hist_write_word(FILE* fd, const Word* word, const Word* match, const Dictionary* dict) {
+	const long id = (dict && ids.hash == dict->hash) ? word_id(dict, word) : -1;
+	int prefix = 0;
+
+	if(id >= 0) put_varint(fd, (uint64_t)id << 1);
+	else {
+		put_varint(fd, (uint64_t)word->len << 1 | 1);
+		fwrite(word->str, 1, word->len, fd);
+	}
+
+	if(!match) return ferror(fd) ? FILE_ERROR : 0;
+	for(; prefix < word->len && prefix < match->len && word->str[prefix] == match->str[prefix]; prefix++);
+	if(prefix == word->len && prefix == match->len)
+		put_varint(fd, 0);
+
+	else {
+		put_varint(fd, prefix+1);
+		put_varint(fd, match->len - prefix);
+		fwrite(match->str + prefix, 1, match->len - prefix, fd);
+	}
+
+	return ferror(fd) ? FILE_ERROR : 0;
+}
+
+/* Format the local time the record of $e was written at to the minute. */
+void hist_time_str(const HistEntry* e, char* buf, size_t sz) {
+	const time_t t = e->time / 1000;
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(buf, sz, "%Y-%m-%d-%H:%M", &tm);
+}
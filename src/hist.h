@@ -0,0 +1,28 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "def.h"
+
+int hist_open(const char*);
+size_t hist_count(void);
+int hist_entry(size_t, HistEntry*);
+int hist_queue(char*, size_t, const HistEntry*, const Dictionary*, size_t);
+void hist_sync(void);
+size_t hist_failed(void);
+void hist_close(void);
+int hist_prune(size_t);
+int hist_summary(HistSummary*);
+void hist_day_str(int32_t, char*, size_t);
+int hist_read(const HistEntry*, char**, size_t*);
+int hist_load(const HistEntry*, History*);
+void hist_prefetch(const HistEntry*, size_t, int);
+int hist_fetch(const HistEntry*, int, const History**, int*);
+void hist_time_str(const HistEntry*, char*, size_t);
+int hist_write_header(FILE*, const HistStats*, const char*, const char*, size_t, size_t, const Dictionary*);
+int hist_write_word(FILE*, const Word*, const Word*, const Dictionary*);
+
+#endif /* HIST_H */
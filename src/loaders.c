@@ -2,15 +2,44 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/stat.h>
 
 #include "loaders.h"
 #include "def.h"
 #include "utils.h"
+#include "rng.h"
+
+#define DICT_CACHE_MAGIC   "PTDC"
+#define DICT_CACHE_VERSION 3
 
 static const char* whitespace = " \n\t";
 
+/* A dictionary cache is laid out as a header, followed by a table of
+ * $nwords entries, followed by a blob of $sz_blob bytes holding every
+ * word's null-terminated string. $src_* describe the dictionary the
+ * cache was compiled from; the cache is stale if they no longer match. */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+	uint64_t nwords;
+	uint64_t sz_blob;
+	uint64_t hash;    /* Dictionary.hash of the words. */
+	uint64_t weighted;/* whether the entries' counts are meaningful. */
+} DictCacheHeader;
+
+typedef struct {
+	uint32_t off;  /* offset of the word into the blob. */
+	uint32_t len;
+	uint32_t count;
+} DictCacheEntry;
+
 static inline bool is_label_char(int c) {
 	return isalnum(c) || c == '_' || c == '-';
 }
@@ -27,421 +56,847 @@ static inline bool is_whitespace(int c) {
 	return c == ' ' || c == '\t' || c == '\n';
 }
 
-static void fskip_until(FILE* fd, bool(*pred)(int)) {
-	int c;
-	while((c = fgetc(fd)) != EOF && !pred(c));
-	ungetc(c, fd);
-}
+static bool is_graph_str(const char* str) {
+	for(; *str; str++)
+		if(!isgraph(*str))
+			return 0;
 
-static int fread_while(FILE* fd, char** value, bool(*pred)(int)) {
-    int c;
-    size_t sz; 
-	size_t cap_value = 16;
-	fpos_t pos;
-	
-	fgetpos(fd, &pos);
-	
-	if(!(*value = calloc(cap_value, sizeof(char*))))
-		return MEM_ERROR;
+	return 1;
+}
 
-    for(sz=0; (c = fgetc(fd)) != EOF && pred(c); sz++) {
-		if(sz == cap_value-1) {
-			char* temp;
+/* Whether the $len bytes at $str are a word followed by a NUL. */
+static bool is_word_str(const char* str, size_t len) {
+	if(len == 0 || str[len] != '\0')
+		return false;
 
-			if(!(temp = realloc(*value, (cap_value*=2)*sizeof(char*)))) {
-				free(*value);
-				fsetpos(fd, &pos);
-				return MEM_ERROR;
-			}
+	for(size_t i=0; i<len; i++)
+		if(!is_word_char((unsigned char)str[i]))
+			return false;
 
-			*value = temp;
-		}
+	return true;
+}
 
-        (*value)[sz] = c; 
-	}
+static bool is_print_str(const char* str) {
+	for(; *str; str++)
+		if(!isprint(*str))
+			return 0;
 
-    ungetc(c, fd);
-	if(sz == 0) return PARSE_ERROR;
-    if(ferror(fd)) return FILE_ERROR;
-    (*value)[sz] = '\0';
-    return 0;
+	return 1;
 }
 
-static int fread_label(FILE* fd, char** label) {
-    int c, result;
-	fpos_t pos;
+/* skip whitespace in [$ptr, $end). */
+static const char* sskipws(const char* ptr, const char* end) {
+	while(ptr < end && *ptr && strchr(whitespace, *ptr))
+		ptr++;
 
-	fgetpos(fd, &pos);
-    fskipws(fd, whitespace);
-    if((result = fread_while(fd, label, is_label_char)) < 0)
-        return result;
+	return ptr;
+}
 
-    fskipws(fd, whitespace);
-    if((c = fgetc(fd)) != ':') {
-		fsetpos(fd, &pos);
-        free(*label);
-        return PARSE_ERROR;
-    }
+static const char* sskip_until(const char* ptr, const char* end, bool(*pred)(int)) {
+	while(ptr < end && !pred((unsigned char)*ptr))
+		ptr++;
 
-	return 0;
+	return ptr;
 }
 
-static int fread_word(FILE* fd, char** word, int delim) {
-	const size_t bsz = 2048;
-	char buf[bsz];
-	int c;
-
-	fpos_t pos;
-	fgetpos(fd, &pos);
+/* Read a word from [$*ptr, $end) into $word, which must have room for at
+ * least MAX_WORD+2 bytes. $*ptr is only advanced on success.
+ * Return the length of the word. */
+static int sread_word(const char** ptr, const char* end, char* word, int delim) {
+	const char* p = *ptr;
+	int i=0;
 
-	size_t i=0;
-	for(i=0; i<bsz; i++) {
-		c = fgetc(fd);
-		if(c == delim || c == EOF) { 
-			ungetc(c, fd);
-			break;
-		}
+	for(; p < end && i <= MAX_WORD; i++, p++) {
+		int c = (unsigned char)*p;
 
+		if(c == delim) break;
 		if(c == '\\') {
-			c = fgetc(fd);
-			if(!is_escape_char(c)) {
-				fsetpos(fd, &pos);
+			if(p+1 == end || !is_escape_char((unsigned char)p[1]))
 				return PARSE_ERROR;
-			}
-		}
 
-		if(!is_word_char(c)) {
-			ungetc(c, fd);
-			break;
+			c = (unsigned char)*++p;
 		}
-			
-		buf[i] = c;
+
+		if(!is_word_char(c)) break;
+		word[i] = c;
 	}
 
-	if(i == 0 || i > MAX_WORD) {
-		fsetpos(fd, &pos);
+	if(i == 0 || i > MAX_WORD)
 		return PARSE_ERROR;
+
+	word[i] = '\0';
+	*ptr = p;
+	return i;
+}
+
+/* Order $dict's words by length, keeping their relative order, and
+ * index where each length starts. Words already in order (e.g. from a
+ * dictionary cache) are only counted. */
+int sort_dict_lengths(Dictionary* dict) {
+	size_t count[MAX_WORD+1] = {0};
+	size_t pos[MAX_WORD+1];
+	bool sorted = true;
+	uint32_t* counts = NULL;
+	Word* words;
+
+	for(size_t i=0; i<dict->sz; i++) {
+		count[dict->words[i].len]++;
+		if(i && dict->words[i].len < dict->words[i-1].len)
+			sorted = false;
 	}
 
-	buf[i] = '\0';
-	if(!(*word = strdup(buf))) {
-		fsetpos(fd, &pos);
+	dict->len_idx[0] = 0;
+	for(int n=0; n<=MAX_WORD; n++)
+		dict->len_idx[n+1] = dict->len_idx[n] + count[n];
+
+	if(sorted) return 0;
+	if(!(words = malloc(dict->sz * sizeof(Word))))
+		return MEM_ERROR;
+
+	if(dict->counts && !(counts = malloc(dict->sz * sizeof(uint32_t)))) {
+		free(words);
 		return MEM_ERROR;
 	}
 
+	memcpy(pos, dict->len_idx, sizeof(pos));
+	for(size_t i=0; i<dict->sz; i++) {
+		const size_t j = pos[dict->words[i].len]++;
+
+		words[j] = dict->words[i];
+		if(counts) counts[j] = dict->counts[i];
+	}
+
+	free(dict->words);
+	free(dict->counts);
+	dict->words = words;
+	dict->counts = counts;
 	return 0;
 }
 
-static bool is_graph_str(const char* str) {
-	for(; *str; str++)
-		if(!isgraph(*str))
-			return 0;
+/* Read the count of a 'word<TAB>count' line, with $*ptr just past the
+ * word. The count may be followed by blanks or a '\r' before the end of
+ * the line. $*ptr is only advanced if a count is there.
+ * Return the count, or -1 if there is none. */
+static long long sread_count(const char** ptr, const char* end) {
+	const char* p = *ptr;
+	long long count = 0;
 
-	return 1;
+	if(p == end || *p++ != '\t' || p == end || !isdigit((unsigned char)*p))
+		return -1;
+
+	for(; p < end && isdigit((unsigned char)*p); p++)
+		if((count = count*10 + (*p - '0')) > UINT32_MAX)
+			count = UINT32_MAX;
+
+	for(; p < end && (*p == ' ' || *p == '\t' || *p == '\r'); p++);
+	if(p < end && *p != '\n')
+		return -1;
+
+	*ptr = p;
+	return count;
 }
 
-static bool is_print_str(const char* str) {
-	for(; *str; str++)
-		if(!isprint(*str))
-			return 0;
+/* Read the next word of the dictionary in $*ptr up to $end into $word,
+ * which needs room for MAX_WORD+2 bytes, skipping malformed ones. The
+ * word's count, or -1 if it has none, is stored in $*count.
+ * Return the word's length, or 0 if there are no words left. */
+int sread_dict_word(const char** ptr, const char* end, char* word, long long* count) {
+	int len;
 
-	return 1;
+	while((*ptr = sskipws(*ptr, end)) < end) {
+		if((len = sread_word(ptr, end, word, EOF)) < 0) {
+			*ptr = sskip_until(*ptr, end, is_whitespace);
+			continue;
+		}
+
+		*count = sread_count(ptr, end);
+		return len;
+	}
+
+	return 0;
+}
+
+/* Return the hash of $dict's words' strings, in order. */
+uint64_t hash_dict(const Dictionary* dict) {
+	uint64_t hash = FNV_OFFSET;
+
+	for(size_t i=0; i<dict->sz; i++)
+		hash = fnv1a(dict->words[i].str, dict->words[i].len+1, hash);
+
+	return hash;
 }
 
-static int fread_words(FILE* fd, Word** words, size_t* sz, int delim) {
-	int result, c;
-    size_t cap_words = 32;
-	
-    *sz = 0;
-	if(!(*words = calloc(cap_words, sizeof(Word))))
+/* Parse every word in $buf in a single pass. The strings are copied
+ * into $dict->blob, which can never be larger than $buf. A word may be
+ * followed by a tab and its count on the rest of the line; words
+ * without one count once. Parsing stops once $*cancel is set, if
+ * $cancel isn't NULL. */
+static int sread_dictionary(const char* buf, size_t sz, Dictionary* dict, const atomic_bool* cancel) {
+	const char* ptr = buf;
+	const char* const end = buf+sz;
+	size_t cap_words = 32;
+	size_t pos = 0;
+	bool weighted = false;
+	long long count;
+	int len;
+
+	dict->sz = 0;
+	dict->words = NULL;
+	dict->counts = NULL;
+	dict->map = NULL;
+	/* leave room for the scratch bytes of a word that is too long. */
+	if(!(dict->blob = malloc(sz + MAX_WORD+2)))
 		return MEM_ERROR;
 
-	while(true) {
-        fskipws(fd, whitespace);
-		c = fgetc(fd);
-		if(c == delim) break;
-		if(c == EOF) {
-			free_words(*words, *sz);
-			return PARSE_ERROR;
+	if(!(dict->words = calloc(cap_words, sizeof(Word)))
+	|| !(dict->counts = calloc(cap_words, sizeof(uint32_t)))) {
+		free_dict(dict);
+		return MEM_ERROR;
+	}
+
+	while((len = sread_dict_word(&ptr, end, &dict->blob[pos], &count)) > 0) {
+		if(cancel && atomic_load(cancel)) {
+			free_dict(dict);
+			return CANCELLED;
 		}
 
-		ungetc(c, fd);
+		if(dict->sz == cap_words) {
+			void* temp;
 
-		if(*sz == cap_words) {
-            void* temp;
+			cap_words *= 2;
+			if(!(temp = realloc(dict->words, cap_words*sizeof(Word)))) {
+				free_dict(dict);
+				return MEM_ERROR;
+			}
 
-			if(!(temp = realloc(*words, (cap_words*=2)*sizeof(Word)))) {
-			    free_words(*words, *sz);
-                return MEM_ERROR;
-            }
+			dict->words = temp;
+			if(!(temp = realloc(dict->counts, cap_words*sizeof(uint32_t)))) {
+				free_dict(dict);
+				return MEM_ERROR;
+			}
 
-            *words = temp;
+			dict->counts = temp;
 		}
 
-		if((result = fread_word(fd, &(*words)[*sz].str, delim)) != 0) {
-			if(result == MEM_ERROR) {
-			    free_words(*words, *sz);
-                return MEM_ERROR;
+		if(count >= 0) weighted = true;
+		dict->counts[dict->sz] = (count >= 0) ? count : 1;
+		dict->words[dict->sz++] = (Word){.str = &dict->blob[pos], .len = len};
+		pos += len+1;
+	}
+
+	if(!weighted) {
+		free(dict->counts);
+		dict->counts = NULL;
+	}
+
+	if(sort_dict_lengths(dict) < 0) {
+		free_dict(dict);
+		return MEM_ERROR;
+	}
+
+	dict->hash = hash_dict(dict);
+	return 0;
+}
+
+int load_dictionary(FILE* fd, Dictionary* dict, const atomic_bool* cancel) {
+	char* buf;
+	size_t sz;
+	int ret;
+
+	if(map_file(fd, &buf, &sz) < 0)
+		return FILE_ERROR;
+
+	ret = sread_dictionary(buf, sz, dict, cancel);
+	unmap_file(buf, sz);
+	return ret;
+}
+
+/* Keep a uniformly random sample of at most $n of the words in $fd,
+ * reading it line by line so no more than the sample is held at once. */
+int load_dictionary_sample(FILE* fd, size_t n, Rng* rng, Dictionary* dict) {
+	const size_t slot = MAX_WORD+1;
+	char word[MAX_WORD+2];
+	char* line = NULL;
+	size_t cap_line = 0, cap_words = 0, seen = 0;
+	bool weighted = false;
+	ssize_t len;
+
+	dict->sz = 0;
+	dict->words = NULL;
+	dict->counts = NULL;
+	dict->blob = NULL;
+	dict->map = NULL;
+	if(n > SIZE_MAX / slot)
+		return MEM_ERROR;
+
+	while((len = getline(&line, &cap_line, fd)) > 0) {
+		const char* ptr = line;
+		long long count;
+		int wlen;
+
+		while((wlen = sread_dict_word(&ptr, line+len, word, &count)) > 0) {
+			size_t i = seen++;
+
+			if(count >= 0) weighted = true;
+			/* the i'th word replaces a random one with probability n/(i+1). */
+			if(i >= n && (i = rng_below(rng, seen)) >= n)
+				continue;
+
+			if(i == cap_words) {
+				cap_words = (cap_words) ? cap_words*2 : 1024;
+				if(cap_words > n) cap_words = n;
+				dict->words = ereallocarray(dict->words, cap_words, sizeof(Word));
+				dict->counts = ereallocarray(dict->counts, cap_words, sizeof(uint32_t));
+				dict->blob = ereallocarray(dict->blob, cap_words, slot);
 			}
 
-			fskip_until(fd, is_whitespace);
-			continue;
+			/* $blob may still move, so $str is only set once it's full. */
+			memcpy(&dict->blob[i*slot], word, wlen+1);
+			dict->words[i].len = wlen;
+			dict->counts[i] = (count >= 0) ? count : 1;
+			if(i == dict->sz) dict->sz++;
 		}
+	}
+
+	free(line);
+	if(ferror(fd)) {
+		free_dict(dict);
+		return FILE_ERROR;
+	}
+
+	for(size_t i=0; i<dict->sz; i++)
+		dict->words[i].str = &dict->blob[i*slot];
+
+	if(!weighted) {
+		free(dict->counts);
+		dict->counts = NULL;
+	}
 
-		(*words)[*sz].len = strlen((*words)[*sz].str);
-		(*sz)++;
+	if(sort_dict_lengths(dict) < 0) {
+		free_dict(dict);
+		return MEM_ERROR;
 	}
-	
+
+	dict->hash = hash_dict(dict);
 	return 0;
 }
 
-int load_dictionary(FILE* fd, Dictionary* dict) {
-	return fread_words(fd, &dict->words, &dict->sz, EOF);
+/* Map the dictionary cache $fd, compiled from the dictionary described by $src. 
+ * Return PARSE_ERROR if the cache is malformed or stale. */
+int load_dict_cache(FILE* fd, const struct stat* src, Dictionary* dict) {
+	const DictCacheHeader* hdr;
+	const DictCacheEntry* table;
+	char* buf;
+	size_t sz;
+
+	if(map_file(fd, &buf, &sz) < 0)
+		return FILE_ERROR;
+
+	hdr = (const DictCacheHeader*)buf;
+	if(sz < sizeof(DictCacheHeader)
+	|| memcmp(hdr->magic, DICT_CACHE_MAGIC, sizeof(hdr->magic)) != 0
+	|| hdr->version != DICT_CACHE_VERSION
+	|| hdr->src_size != (uint64_t)src->st_size
+	|| hdr->src_mtime_sec != (int64_t)src->st_mtim.tv_sec
+	|| hdr->src_mtime_nsec != (int64_t)src->st_mtim.tv_nsec
+	|| hdr->nwords > (sz - sizeof(DictCacheHeader)) / sizeof(DictCacheEntry)
+	|| sz != sizeof(DictCacheHeader) + hdr->nwords*sizeof(DictCacheEntry) + hdr->sz_blob) {
+		unmap_file(buf, sz);
+		return PARSE_ERROR;
+	}
+
+	table = (const DictCacheEntry*)(buf + sizeof(DictCacheHeader));
+	dict->sz = hdr->nwords;
+	dict->hash = hdr->hash;
+	dict->blob = (char*)(table + dict->sz);
+	dict->map = buf;
+	dict->sz_map = sz;
+	dict->counts = NULL;
+	if(!(dict->words = calloc(dict->sz ? dict->sz : 1, sizeof(Word)))
+	|| (hdr->weighted && !(dict->counts = calloc(dict->sz ? dict->sz : 1, sizeof(uint32_t))))) {
+		free_dict(dict);
+		return MEM_ERROR;
+	}
+
+	for(size_t i=0; i<dict->sz; i++) {
+		/* a damaged cache mustn't yield unterminated strings. */
+		if(table[i].len > MAX_WORD
+		|| (uint64_t)table[i].off + table[i].len >= hdr->sz_blob
+		|| !is_word_str(&dict->blob[table[i].off], table[i].len)) {
+			free_dict(dict);
+			return PARSE_ERROR;
+		}
+
+		dict->words[i].str = &dict->blob[table[i].off];
+		dict->words[i].len = table[i].len;
+		if(dict->counts) dict->counts[i] = table[i].count;
+	}
+
+	if(sort_dict_lengths(dict) < 0) {
+		free_dict(dict);
+		return MEM_ERROR;
+	}
+
+	return 0;
 }
 
-static int load_quote_text(FILE* fd, Quote* quote) {
-	int result, c;
+/* Compile $dict, loaded from the dictionary described by $src, into a cache. */
+int write_dict_cache(FILE* fd, const Dictionary* dict, const struct stat* src) {
+	DictCacheHeader hdr;
+	uint64_t sz_blob = 0;
+
+	/* the blob only needs to span up to the end of the last word. */
+	for(size_t i=0; i<dict->sz; i++) {
+		const uint64_t end = (dict->words[i].str - dict->blob) + dict->words[i].len + 1;
+		if(end > sz_blob) sz_blob = end;
+	}
 
-	fskipws(fd, whitespace);
-	if((c = fgetc(fd)) != '{') {
-		ungetc(c, fd);
+	if(sz_blob > UINT32_MAX)
 		return PARSE_ERROR;
+
+	memcpy(hdr.magic, DICT_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version        = DICT_CACHE_VERSION;
+	hdr.src_size       = src->st_size;
+	hdr.src_mtime_sec  = src->st_mtim.tv_sec;
+	hdr.src_mtime_nsec = src->st_mtim.tv_nsec;
+	hdr.nwords         = dict->sz;
+	hdr.sz_blob        = sz_blob;
+	hdr.hash           = dict->hash;
+	hdr.weighted       = dict->counts != NULL;
+	if(fwrite(&hdr, sizeof(hdr), 1, fd) != 1)
+		return FILE_ERROR;
+
+	for(size_t i=0; i<dict->sz; i++) {
+		const DictCacheEntry entry = {
+			.off = dict->words[i].str - dict->blob,
+			.len = dict->words[i].len,
+			.count = (dict->counts) ? dict->counts[i] : 1,
+		};
+
+		if(fwrite(&entry, sizeof(entry), 1, fd) != 1)
+			return FILE_ERROR;
 	}
 
-	if((result = fread_words(fd, &quote->text, &quote->sz, '}')) < 0)
-		return result;
+	if(sz_blob && fwrite(dict->blob, sz_blob, 1, fd) != 1)
+		return FILE_ERROR;
 
 	return 0;
 }
 
-static int load_quote_labels(FILE* fd, Quote* quote) {
-    static char* quote_labels[] = { "author", "source", NULL };
-    char** quote_vals[] = { &quote->author, &quote->source };
-    const size_t bsz = 2048;
-    char buf[bsz];
-    fpos_t pos;
-
-    quote->author = NULL;
-    quote->source = NULL;
-    while(true) {
-        int i, blen;
-        char* label;
-
-	    fskipws(fd, whitespace);
-        if(fread_label(fd, &label) < 0)
-            break;
-
-		fskipws(fd, whitespace);
-        if((i = find_stri(quote_labels, label)) < 0
-		|| !fgets(buf, bsz, fd)
-		|| (blen = strlen(buf)) == 1) {
-            free(quote->author);
-            free(quote->source);
-            free(label);
-            return PARSE_ERROR;
-        }
-
-        free(label);
+/* Read the words of a quote's text up to its closing '}'; $text may be NULL
+ * if the words only need to be counted, otherwise the words' strings are
+ * copied into $blob (which must be at least as large as the text).
+ * Return the number of words read. */
+static long sread_quote_words(const char** ptr, const char* end, Word* text, char* blob) {
+	char scratch[MAX_WORD+2];
+	size_t pos = 0;
+	long sz = 0;
+	int len;
+
+	while(true) {
+		char* const word = (text) ? &blob[pos] : scratch;
+
+		if((*ptr = sskipws(*ptr, end)) == end)
+			return PARSE_ERROR;
+
+		if(**ptr == '}') {
+			(*ptr)++;
+			break;
+		}
+
+		if((len = sread_word(ptr, end, word, '}')) < 0) {
+			*ptr = sskip_until(*ptr, end, is_whitespace);
+			continue;
+		}
+
+		if(text) {
+			text[sz] = (Word){.str = word, .len = len};
+			pos += len+1;
+		}
+
+		sz++;
+	}
+
+	return sz;
+}
+
+/* Read a label terminated by ':' & return it's length. */
+static int sread_label(const char** ptr, const char* end, const char** label) {
+	const char* p = sskipws(*ptr, end);
+	int len = 0;
+
+	*label = p;
+	for(; p < end && is_label_char((unsigned char)*p); p++, len++);
+	if(len == 0) return PARSE_ERROR;
+
+	p = sskipws(p, end);
+	if(p == end || *p != ':')
+		return PARSE_ERROR;
+
+	*ptr = p+1;
+	return len;
+}
+
+static int sread_quote_labels(const char** ptr, const char* end, Quote* quote) {
+	static char* quote_labels[] = { "author", "source", NULL };
+	char** quote_vals[] = { &quote->author, &quote->source };
+	const size_t bsz = 2048;
+	char buf[bsz];
+
+	quote->author = NULL;
+	quote->source = NULL;
+	while(true) {
+		const char* label, *nl;
+		int i, llen;
+		size_t blen;
+
+		if((llen = sread_label(ptr, end, &label)) < 0)
+			break;
+
+		*ptr = sskipws(*ptr, end);
+		memcpy(buf, label, llen);
+		buf[llen] = '\0';
+		if((i = find_stri(quote_labels, buf)) < 0 || *ptr == end) {
+			free(quote->author);
+			free(quote->source);
+			return PARSE_ERROR;
+		}
+
+		/* the value is the rest of the line. */
+		nl = memchr(*ptr, '\n', end - *ptr);
+		blen = (nl) ? (size_t)(nl - *ptr) + 1 : (size_t)(end - *ptr);
+		if(blen > bsz-1) blen = bsz-1;
+		memcpy(buf, *ptr, blen);
+		buf[blen] = '\0';
+		*ptr += blen;
+
+		if(blen == 1) {
+			free(quote->author);
+			free(quote->source);
+			return PARSE_ERROR;
+		}
+
 		buf[blen-1] = '\0'; /* remove newline */
 
 		if(!is_print_str(buf)) {
-            free(quote->author);
-            free(quote->source);
-            return PARSE_ERROR;
+			free(quote->author);
+			free(quote->source);
+			return PARSE_ERROR;
 		}
 
-        if(*quote_vals[i]) free(*quote_vals[i]);
-        if(!(*quote_vals[i] = strdup(buf))) {
-            free(quote->author);
-            free(quote->source);
-            return MEM_ERROR;
-        }
-    }
+		if(*quote_vals[i]) free(*quote_vals[i]);
+		if(!(*quote_vals[i] = strdup(buf))) {
+			free(quote->author);
+			free(quote->source);
+			return MEM_ERROR;
+		}
+	}
 
-    return 0;
+	return 0;
 }
 
-static void find_end_of_quote(FILE* fd) {
-	int c;
-	while((c = fgetc(fd)) != EOF && c != '}')
-		if(c == '\\') (void)fgetc(fd);
+static const char* sfind_end_of_quote(const char* ptr, const char* end) {
+	for(; ptr < end && *ptr != '}'; ptr++)
+		if(*ptr == '\\' && ptr+1 < end) ptr++;
+
+	return (ptr < end) ? ptr+1 : end;
 }
 
-int load_quotes(FILE* fd, Quotes* quotes) {
-	int ret;
+/* Index every quote in $buf; only the offset of each quote's text & it's
+ * word count is recorded, the text itself is read by load_quote_text().
+ * Indexing stops once $*cancel is set, if $cancel isn't NULL. */
+int sread_quotes(const char* buf, size_t sz, Quotes* quotes, const atomic_bool* cancel) {
+	const char* ptr = buf;
+	const char* const end = buf+sz;
 	size_t cap_quotes = 32;
+	long nwords;
 
 	if(!(quotes->quotes = calloc(cap_quotes, sizeof(Quote))))
 		return MEM_ERROR;
 
 	quotes->sz = 0;
-	while(true) {
-        int c;
+	while((ptr = sskipws(ptr, end)) < end) {
+		if(cancel && atomic_load(cancel)) {
+			for(size_t i=0; i<quotes->sz; i++)
+				free_quote(&quotes->quotes[i]);
 
-		fskipws(fd, whitespace);
-        if((c = fgetc(fd)) == EOF) break; 
-        ungetc(c, fd);
+			free(quotes->quotes);
+			return CANCELLED;
+		}
 
 		if(quotes->sz == cap_quotes) {
-            void* temp;
+			void* temp;
 
 			if(!(temp = realloc(quotes->quotes, (cap_quotes*=2)*sizeof(Quote)))) {
-                free_quotes(quotes);
-                free(quotes->quotes);
-                return MEM_ERROR;
-            }
+				for(size_t i=0; i<quotes->sz; i++)
+					free_quote(&quotes->quotes[i]);
 
-            quotes->quotes = temp;
-        }
+				free(quotes->quotes);
+				return MEM_ERROR;
+			}
+
+			quotes->quotes = temp;
+		}
 
 		Quote* const curr_quote = &quotes->quotes[quotes->sz];
-        if((ret = load_quote_labels(fd, curr_quote)) < 0) {
-			find_end_of_quote(fd);
+		if(sread_quote_labels(&ptr, end, curr_quote) < 0) {
+			ptr = sfind_end_of_quote(ptr, end);
 			continue;
-        }
+		}
+
+		ptr = sskipws(ptr, end);
+		if(ptr == end || *ptr != '{') {
+			free(curr_quote->author);
+			free(curr_quote->source);
+			ptr = sfind_end_of_quote(ptr, end);
+			continue;
+		}
 
-		if((ret = load_quote_text(fd, curr_quote)) < 0) {
+		curr_quote->off = ++ptr - buf;
+		if((nwords = sread_quote_words(&ptr, end, NULL, NULL)) <= 0) {
 			free(curr_quote->author);
 			free(curr_quote->source);
-			find_end_of_quote(fd);
 			continue;
 		}
 
+		curr_quote->len = (ptr - buf) - curr_quote->off;
+		curr_quote->sz = nwords;
 		quotes->sz++;
 	}
-	
+
 	return 0;
 }
 
-int fread_hist_text(FILE* fd, Word** text) {
-	size_t cap_text = 64;
-	size_t bsz = 256;
-	char* word = malloc(bsz);
+int load_quotes(FILE* fd, Quotes* quotes, const atomic_bool* cancel) {
+	int ret;
 
-	if(!word) return -1;
-	if(!(*text = calloc(cap_text, sizeof(Word)))) {
-		free(word);
-		return -1;
-	}
+	if(map_file(fd, &quotes->map, &quotes->sz_map) < 0)
+		return FILE_ERROR;
 
-	fskipws(fd, whitespace);
-	/* ascii-STX (start of text) */
-	if(fgetc(fd) != '\002') {
-		free(word);
-		free(*text);
-		return -1;
+	if((ret = sread_quotes(quotes->map, quotes->sz_map, quotes, cancel)) < 0) {
+		unmap_file(quotes->map, quotes->sz_map);
+		quotes->map = NULL;
+		return ret;
 	}
 
-	size_t i=0;
-	for(; ; i++) {
-		int c;
+	return 0;
+}
 
-		/* ascii-ETX (end of text) */
-		if((c = fgetc(fd)) == '\003') break;
-		ungetc(c, fd);
-		if(i == cap_text) {
-			Word* temp;
-			if(!(temp = realloc(*text, (cap_text*=2)*sizeof(Word)))) {
-				free(word);	
-				free_words(*text, i);
-				return -1;
-			}
+/* Read the next quote in $fd, up to the '}' closing its text, into $*buf
+ * of capacity $*cap. Return its length, or 0 if there are none left. */
+static size_t fread_quote_entry(FILE* fd, char** buf, size_t* cap) {
+	bool in_text = false;
+	size_t len = 0;
+	int c;
 
-			*text = temp;
+	while((c = fgetc(fd)) != EOF) {
+		if(len+2 >= *cap) {
+			*cap = (*cap) ? *cap*2 : 256;
+			*buf = ereallocarray(*buf, *cap, 1);
 		}
 
-		if(getdelim(&word, &bsz, 0, fd) < 0) {
-			free(word);	
-			free_words(*text, i);
-			return -1;
+		(*buf)[len++] = c;
+		if(c == '\\' && (c = fgetc(fd)) != EOF) (*buf)[len++] = c;
+		else if(c == '{') in_text = true;
+		else if(c == '}' && in_text) return len;
+	}
+
+	/* a quote cut off by EOF is malformed. */
+	return 0;
+}
+
+/* Keep a uniformly random sample of at most $n of the quotes in $fd,
+ * reading it one quote at a time so no more than the sample is held at
+ * once. The sample is then written to a temporary quotes-file, which
+ * $quotes is loaded from. */
+int load_quotes_sample(FILE* fd, size_t n, Rng* rng, Quotes* quotes) {
+	char** sample = NULL;
+	size_t* lens = NULL;
+	size_t sz = 0, cap_sample = 0, seen = 0;
+	char* buf = NULL;
+	size_t cap_buf = 0, len;
+	FILE* spool;
+	int ret = 0;
+
+	while((len = fread_quote_entry(fd, &buf, &cap_buf)) > 0) {
+		Quotes q;
+		size_t i;
+
+		/* malformed quotes aren't counted. */
+		if(sread_quotes(buf, len, &q, NULL) < 0) {
+			ret = MEM_ERROR;
+			break;
 		}
 
-		if(!is_print_str(word)
-		|| !((*text)[i].str = strdup(word))) {
-			free(word);
-			free_words(*text, i);
-			return -1;
+		for(i=0; i<q.sz; i++)
+			free_quote(&q.quotes[i]);
+
+		free(q.quotes);
+		if(q.sz != 1) continue;
+
+		/* the i'th quote replaces a random one with probability n/(i+1). */
+		if((i = seen++) >= n && (i = rng_below(rng, seen)) >= n)
+			continue;
+
+		if(i == sz) {
+			if(sz == cap_sample) {
+				cap_sample = (cap_sample) ? cap_sample*2 : 64;
+				sample = ereallocarray(sample, cap_sample, sizeof(char*));
+				lens = ereallocarray(lens, cap_sample, sizeof(size_t));
+			}
+
+			sample[sz++] = NULL;
 		}
 
-		(*text)[i].len = strlen(word);
+		free(sample[i]);
+		sample[i] = ereallocarray(NULL, len, 1);
+		memcpy(sample[i], buf, len);
+		lens[i] = len;
 	}
 
-	free(word);
-	return i;
+	free(buf);
+	if(ret == 0 && ferror(fd)) ret = FILE_ERROR;
+	if(ret == 0 && !(spool = tmpfile())) ret = FILE_ERROR;
+	if(ret == 0) {
+		for(size_t i=0; i<sz; i++)
+			if(fwrite(sample[i], 1, lens[i], spool) != lens[i] || fputc('\n', spool) == EOF)
+				ret = FILE_ERROR;
+
+		if(ret == 0 && (fflush(spool) == EOF || fseek(spool, 0, SEEK_SET) < 0))
+			ret = FILE_ERROR;
+
+		/* the mapping remains valid after the spool is closed. */
+		if(ret == 0) ret = load_quotes(spool, quotes, NULL);
+		fclose(spool);
+	}
+
+	free_strs(sample, sz);
+	free(sample);
+	free(lens);
+	return ret;
 }
 
-int load_hist(FILE* fd, History* h) {
-	const size_t bsz = 1024;
-	char buf[bsz];
-	const int cap = 64;
+/* Tokenize the text of $quote, indexed from $quotes. $text's words are
+ * stored in $blob; both should be freed by the caller. */
+int load_quote_text(const Quotes* quotes, const Quote* quote, Word** text, char** blob) {
+	const char* ptr = quotes->map + quote->off;
+	const char* const end = ptr + quote->len;
 
-	if(!(h->stats = calloc(cap, sizeof(NameVal))))
-		return -1;
+	if(!(*text = calloc(quote->sz, sizeof(Word))))
+		return MEM_ERROR;
 
-	h->sz_stats=0;
-	for(; ; h->sz_stats++) {
-		char c, *label;
+	/* the text can't be longer than the span of the quote. */
+	if(!(*blob = malloc(quote->len + MAX_WORD+2))) {
+		free(*text);
+		return MEM_ERROR;
+	}
 
-		fskipws(fd, whitespace);
-		c = fgetc(fd);
-		ungetc(c, fd);
-		if(c == EOF || c == STX) break;
+	if(sread_quote_words(&ptr, end, *text, *blob) != (long)quote->sz) {
+		free(*text);
+		free(*blob);
+		return PARSE_ERROR;
+	}
 
-		if(h->sz_stats == cap-1) {
-			free_namevals(h->stats, h->sz_stats);
-			free(h->stats);
-			return -1;
-		}
+	return 0;
+}
 
-		if((fread_label(fd, &label)) < 0) {
-			free_namevals(h->stats, h->sz_stats);
-			free(h->stats);
-			return -1;
-		}
+/* Read the words of a section of a text history record: NUL terminated
+ * words enclosed by STX & ETX. $words may be NULL if the words only need
+ * to be counted, otherwise they point into the record. Return the number
+ * of words read. */
+static long sread_hist_words(const char** ptr, const char* end, Word* words) {
+	const char* p = sskipws(*ptr, end);
+	long sz = 0;
 
-		fskipws(fd, " \t");
-		if(get_delims(fd, buf, bsz, "\n") < 0
-		|| strlen(buf) <= 1) {
-			free_namevals(h->stats, h->sz_stats);
-			free(h->stats);
-			free(label);
-			return -1;
-		}
+	if(p == end || *p++ != STX)
+		return PARSE_ERROR;
 
-		buf[strlen(buf)-1] = '\0';
-		if(!is_print_str(buf) 
-		|| !(h->stats[h->sz_stats].val = strdup(buf))) {
-			free_namevals(h->stats, h->sz_stats);
-			free(h->stats);
-			free(label);
-			return -1;
-		}
+	while(p < end && *p != ETX) {
+		const char* const nul = memchr(p, '\0', end - p);
 
-		h->stats[h->sz_stats].name = label;
+		if(!nul || !is_print_str(p))
+			return PARSE_ERROR;
+
+		if(words) words[sz] = (Word){.str = (char*)p, .len = nul - p};
+		sz++;
+		p = nul+1;
 	}
 
-	memset(&h->stats[h->sz_stats], 0, sizeof(NameVal));
+	if(p == end) return PARSE_ERROR;
+	*ptr = p+1;
+	return sz;
+}
 
-	if((h->nwords = fread_hist_text(fd, &h->text)) < 0) {
-		free_namevals(h->stats, h->sz_stats);
-		free(h->stats);
-		return -1;
+/* Read the "label: value" lines at the head of a text history record into
+ * $h's stats, which point into the record. */
+static int sread_hist_stats(const char** ptr, const char* end, History* h) {
+	const int cap = 64;
+
+	for(h->sz_stats=0; ; h->sz_stats++) {
+		const char* label, *eol;
+		int len;
+
+		*ptr = sskipws(*ptr, end);
+		if(*ptr == end || **ptr == STX) break;
+		if(h->sz_stats == cap-1 || (len = sread_label(ptr, end, &label)) < 0)
+			return PARSE_ERROR;
+
+		for(; *ptr < end && (**ptr == ' ' || **ptr == '\t'); (*ptr)++);
+		if(!(eol = memchr(*ptr, '\n', end - *ptr)) || eol == *ptr)
+			return PARSE_ERROR;
+
+		((char*)label)[len] = '\0';
+		((char*)eol)[0] = '\0';
+		if(!is_print_str(*ptr))
+			return PARSE_ERROR;
+
+		h->stats[h->sz_stats] = (NameVal){.name = (char*)label, .val = (char*)*ptr};
+		*ptr = eol+1;
 	}
 
-	if((h->nmatches = fread_hist_text(fd, &h->matches)) < 0) {
-		free_words(h->text, h->nwords);
-		free_namevals(h->stats, h->sz_stats);
-		free(h->stats);
-		return -1;
+	return 0;
+}
+
+/* Parse the history record $rec of $len bytes, in the text format records
+ * were written in before they were binary, into $h. */
+int load_hist(const char* rec, size_t len, History* h) {
+	const int cap = 64;
+	const char* ptr, *probe, *end;
+	long nwords, nmatches;
+
+	*h = (History){0};
+	h->strs = malloc(len+1);
+	h->stats = calloc(cap, sizeof(NameVal));
+	if(!h->strs || !h->stats) {
+		free_hist(h);
+		return MEM_ERROR;
 	}
 
-	if(h->nwords < h->nmatches) {
-		free_words(h->text, h->nwords);
-		free_words(h->matches, h->nmatches);
-		free_namevals(h->stats, h->sz_stats);
-		free(h->stats);
-		return -1;
+	memcpy(h->strs, rec, len);
+	h->strs[len] = '\0';
+	ptr = h->strs;
+	end = ptr + len;
+	if(sread_hist_stats(&ptr, end, h) < 0) {
+		free_hist(h);
+		return PARSE_ERROR;
+	}
+
+	probe = ptr;
+	if((nwords = sread_hist_words(&probe, end, NULL)) < 0
+	|| (nmatches = sread_hist_words(&probe, end, NULL)) < 0
+	|| nwords < nmatches || nwords > INT_MAX) {
+		free_hist(h);
+		return PARSE_ERROR;
+	}
+
+	h->text = calloc(nwords ? nwords : 1, sizeof(Word));
+	h->matches = calloc(nmatches ? nmatches : 1, sizeof(Word));
+	if(!h->text || !h->matches) {
+		free_hist(h);
+		return MEM_ERROR;
 	}
 
+	h->nwords = sread_hist_words(&ptr, end, h->text);
+	h->nmatches = sread_hist_words(&ptr, end, h->matches);
 	return 0;
 }
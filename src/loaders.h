@@ -1,10 +1,22 @@
 #ifndef LOADERS_H
 #define LOADERS_H
 
+#include <stdint.h>
+#include <sys/stat.h>
+
 #include "def.h"
 
-int load_dictionary(FILE*, Dictionary*);
-int load_quotes(FILE*, Quotes*);
-int load_hist(FILE*, History*);
+int load_dictionary(FILE*, Dictionary*, const atomic_bool*);
+int load_dictionary_sample(FILE*, size_t, Rng*, Dictionary*);
+int sread_dict_word(const char**, const char*, char*, long long*);
+int sort_dict_lengths(Dictionary*);
+uint64_t hash_dict(const Dictionary*);
+int load_dict_cache(FILE*, const struct stat*, Dictionary*);
+int write_dict_cache(FILE*, const Dictionary*, const struct stat*);
+int load_quotes(FILE*, Quotes*, const atomic_bool*);
+int sread_quotes(const char*, size_t, Quotes*, const atomic_bool*);
+int load_quotes_sample(FILE*, size_t, Rng*, Quotes*);
+int load_quote_text(const Quotes*, const Quote*, Word**, char**);
+int load_hist(const char*, size_t, History*);
 
 #endif /* LOADERS_H */
@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "rng.h"
+#include "def.h"
+
+static inline uint64_t rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+/* Advance $state and return the next output of the splitmix64 generator. */
+uint64_t splitmix64(uint64_t* state) {
+	uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+
+	z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return z ^ (z >> 31);
+}
+
+/* Seed $rng from a single 64 bit value. splitmix64 never produces
+ * the all-zero state xoshiro can't leave. */
+void rng_seed(Rng* rng, uint64_t seed) {
+	for(int i=0; i<4; i++)
+		rng->s[i] = splitmix64(&seed);
+}
+
+uint64_t rng_next(Rng* rng) {
+	uint64_t* const s = rng->s;
+	const uint64_t result = rotl(s[1] * 5, 7) * 9;
+	const uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return result;
+}
+
+/* Return a uniformly distributed integer in [0, $n), or 0 if $n is 0.
+ * Uses Lemire's multiply-and-reject method, which avoids the bias
+ * of taking a remainder and rarely needs a division. */
+size_t rng_below(Rng* rng, size_t n) {
+	const uint32_t bound = n;
+	uint64_t m;
+
+	if(n == 0) return 0;
+	if(n > UINT32_MAX) return rng_next(rng) % n; /* bias is negligible. */
+
+	m = (rng_next(rng) >> 32) * bound;
+	if((uint32_t)m < bound) {
+		const uint32_t threshold = -bound % bound;
+
+		while((uint32_t)m < threshold)
+			m = (rng_next(rng) >> 32) * bound;
+	}
+
+	return m >> 32;
+}
+
+/* Build $at for sampling indices of $weights with probability
+ * proportional to their weight. $at is left empty on failure or if
+ * every weight is 0. */
+int alias_build(AliasTable* at, const uint32_t* weights, size_t n) {
+	size_t nsmall = 0, nlarge = 0;
+	double total = 0;
+	uint32_t* work;
+	void* temp;
+
+	at->sz = 0;
+	for(size_t i=0; i<n; i++)
+		total += weights[i];
+
+	if(n == 0 || n > UINT32_MAX || total == 0)
+		return -1;
+
+	if(!(temp = realloc(at->prob, n * sizeof(double))))
+		return -1;
+
+	at->prob = temp;
+	if(!(temp = realloc(at->alias, n * sizeof(uint32_t))))
+		return -1;
+
+	at->alias = temp;
+	/* the small and large stacks grow towards each other. */
+	if(!(work = malloc(n * sizeof(uint32_t))))
+		return -1;
+
+	for(size_t i=0; i<n; i++) {
+		at->prob[i] = weights[i] * (double)n / total;
+		at->alias[i] = i;
+		if(at->prob[i] < 1) work[nsmall++] = i;
+		else work[n-1 - nlarge++] = i;
+	}
+
+	while(nsmall && nlarge) {
+		const uint32_t small = work[--nsmall];
+		const uint32_t large = work[n - nlarge];
+
+		at->alias[small] = large;
+		at->prob[large] -= 1 - at->prob[small];
+		if(at->prob[large] < 1) {
+			nlarge--;
+			work[nsmall++] = large;
+		}
+	}
+
+	/* whatever is left is 1 up to rounding error. */
+	while(nsmall) at->prob[work[--nsmall]] = 1;
+	while(nlarge) at->prob[work[n - nlarge--]] = 1;
+
+	free(work);
+	at->sz = n;
+	return 0;
+}
+
+size_t alias_sample(const AliasTable* at, Rng* rng) {
+	const size_t i = rng_below(rng, at->sz);
+	const double u = (rng_next(rng) >> 11) * 0x1.0p-53;
+
+	return (u < at->prob[i]) ? i : at->alias[i];
+}
@@ -0,0 +1,16 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "def.h"
+
+uint64_t splitmix64(uint64_t*);
+void rng_seed(Rng*, uint64_t);
+uint64_t rng_next(Rng*);
+size_t rng_below(Rng*, size_t);
+int alias_build(AliasTable*, const uint32_t*, size_t);
+size_t alias_sample(const AliasTable*, Rng*);
+
+#endif /* RNG_H */
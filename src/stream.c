@@ -0,0 +1,471 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stream.h"
+#include "def.h"
+#include "utils.h"
+#include "loaders.h"
+
+#define STREAM_BLOB_SIZE 65536
+#define STREAM_READ_SIZE 8192
+#define STREAM_FRAME_MAX (1 << 20) /* a longer frame ends the stream. */
+
+/* Words or quotes read from a pipe on a reader thread, a frame at a time:
+ * a line of a dictionary, or a quote up to the '}' closing its text. Only
+ * whole frames are taken in, by stream_dict_update() or
+ * stream_quotes_update(). A dictionary's words are kept in the order
+ * they're read, their strings packed into blobs allocated from $arena,
+ * which never move, so only the words read since the last update are
+ * ever copied out. A quotes-file's frames are appended to $spool, which
+ * each update maps afresh. */
+struct Stream {
+	int fd;
+	pid_t pid;              /* the executable writing to $fd, or -1. */
+	int wake[2];            /* written to by stream_close() to stop the reader. */
+	bool is_quotes;
+	size_t max;             /* words, or bytes of quotes, to read at most; 0 for no limit. */
+	pthread_mutex_t lock;
+	pthread_cond_t grown;   /* signalled as frames are read, and at EOF. */
+	bool eof;
+	bool closed;            /* by stream_close(). */
+	bool done;              /* the reader is finished with the stream. */
+	size_t sz;              /* words or quotes read. */
+	size_t cap;
+	size_t taken;           /* words or quotes in the last update. */
+	/* a dictionary's. */
+	Arena arena;
+	char* blob;             /* blob being filled. */
+	size_t blob_used;
+	Word* words;
+	uint32_t* counts;
+	uint64_t hash;          /* of the words' strings, in the order read. */
+	bool weighted;
+	/* a quotes-file's. */
+	int spool;
+	size_t sz_spool;
+	Quote* quotes;          /* each quote's text is at an offset into $spool. */
+};
+
+/* Where scanning a buffer for the end of its first frame left off. */
+typedef struct {
+	size_t pos;
+	bool in_text;           /* a quote's '{' was scanned. */
+	bool escaped;           /* the last byte scanned was a '\\'. */
+} FrameScan;
+
+static void free_stream(Stream* s) {
+	for(size_t i=s->taken; s->quotes && i<s->sz; i++)
+		free_quote(&s->quotes[i]);
+
+	free(s->quotes);
+	free(s->words);
+	free(s->counts);
+	arena_free(&s->arena);
+	if(s->spool >= 0) close(s->spool);
+	close(s->wake[0]);
+	close(s->wake[1]);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->grown);
+	free(s);
+}
+
+/* Close $fd and stop the executable $pid writing to it, along with
+ * anything it started; its exit status is of no interest. */
+static void stop_input(int fd, pid_t pid) {
+	close(fd);
+	if(pid <= 0) return;
+	kill(-pid, SIGTERM);
+	while(waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+}
+
+/* Return the length of the first frame of the $len bytes at $buf,
+ * or 0 if it isn't complete yet. */
+static size_t next_frame(const Stream* s, const char* buf, size_t len, FrameScan* scan) {
+	if(!s->is_quotes) {
+		const char* const nl = memchr(&buf[scan->pos], '\n', len - scan->pos);
+
+		scan->pos = (nl) ? (size_t)(nl - buf) + 1 : len;
+		return (nl) ? scan->pos : 0;
+	}
+
+	while(scan->pos < len) {
+		const char c = buf[scan->pos++];
+
+		if(scan->escaped) scan->escaped = false;
+		else if(c == '\\') scan->escaped = true;
+		else if(c == '{') scan->in_text = true;
+		else if(c == '}' && scan->in_text) {
+			scan->in_text = false;
+			return scan->pos;
+		}
+	}
+
+	return 0;
+}
+
+/* Add the words of the $len byte line at $line. Return whether
+ * there's room for more. */
+static bool add_words(Stream* s, const char* line, size_t len) {
+	char word[MAX_WORD+2];
+	const char* ptr = line;
+	long long count;
+	int n;
+	bool more;
+
+	pthread_mutex_lock(&s->lock);
+	while((!s->max || s->sz < s->max)
+	&& (n = sread_dict_word(&ptr, line+len, word, &count)) > 0) {
+		if(s->sz == s->cap) {
+			s->cap = (s->cap) ? s->cap*2 : 1024;
+			s->words = ereallocarray(s->words, s->cap, sizeof(Word));
+			s->counts = ereallocarray(s->counts, s->cap, sizeof(uint32_t));
+		}
+
+		if(count >= 0) s->weighted = true;
+		s->counts[s->sz] = (count >= 0) ? count : 1;
+		if(!s->blob || STREAM_BLOB_SIZE - s->blob_used < (size_t)n+1) {
+			s->blob = arena_alloc(&s->arena, STREAM_BLOB_SIZE, 1);
+			s->blob_used = 0;
+		}
+
+		s->words[s->sz].str = memcpy(&s->blob[s->blob_used], word, n+1);
+		s->blob_used += n+1;
+		s->words[s->sz++].len = n;
+		s->hash = fnv1a(word, n+1, s->hash);
+	}
+
+	more = !s->max || s->sz < s->max;
+	pthread_cond_broadcast(&s->grown);
+	pthread_mutex_unlock(&s->lock);
+	return more;
+}
+
+/* Add the quote framed by the $len bytes at $frame, appending them to
+ * the spool. Return whether there's room for more. */
+static bool add_quote(Stream* s, const char* frame, size_t len) {
+	Quotes q;
+
+	if(s->max && s->sz_spool + len > s->max)
+		return false;
+
+	if(sread_quotes(frame, len, &q, NULL) < 0)
+		return false;
+
+	/* a malformed quote is dropped. */
+	if(q.sz == 0) {
+		free(q.quotes);
+		return true;
+	}
+
+	for(size_t off=0; off < len;) {
+		const ssize_t n = write(s->spool, &frame[off], len - off);
+
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) {
+			free_quote(&q.quotes[0]);
+			free(q.quotes);
+			return false;
+		}
+
+		off += n;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if(s->sz == s->cap) {
+		s->cap = (s->cap) ? s->cap*2 : 64;
+		s->quotes = ereallocarray(s->quotes, s->cap, sizeof(Quote));
+	}
+
+	q.quotes[0].off += s->sz_spool;
+	s->quotes[s->sz++] = q.quotes[0];
+	s->sz_spool += len;
+	pthread_cond_broadcast(&s->grown);
+	pthread_mutex_unlock(&s->lock);
+	free(q.quotes);
+	return true;
+}
+
+static void* run_reader(void* arg) {
+	Stream* const s = arg;
+	struct pollfd fds[2] = {
+		{.fd = s->fd,      .events = POLLIN},
+		{.fd = s->wake[0], .events = POLLIN},
+	};
+	FrameScan scan = {.pos = 0};
+	char* buf = NULL;
+	size_t len = 0, cap = 0;
+	bool more = true, eof = false;
+	bool closed;
+	pid_t pid;
+
+	while(more) {
+		size_t start = 0, end;
+		ssize_t n;
+
+		if(poll(fds, 2, -1) < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+
+		if(fds[1].revents) break;
+		if(len >= STREAM_FRAME_MAX) break;
+		if(cap - len < STREAM_READ_SIZE) {
+			cap = (cap) ? cap*2 : STREAM_READ_SIZE*2;
+			buf = ereallocarray(buf, cap, 1);
+		}
+
+		n = read(s->fd, &buf[len], cap - len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) {
+			eof = n == 0;
+			break;
+		}
+
+		len += n;
+		while(more && (end = next_frame(s, &buf[start], len - start, &scan)) > 0) {
+			more = (s->is_quotes) ? add_quote(s, &buf[start], end) : add_words(s, &buf[start], end);
+			start += end;
+			scan.pos = 0;
+		}
+
+		/* keep only the frame still being read. */
+		memmove(buf, &buf[start], len - start);
+		len -= start;
+	}
+
+	/* a dictionary's last line needn't end in a newline. */
+	if(eof && more && len && !s->is_quotes)
+		add_words(s, buf, len);
+
+	free(buf);
+	/* once reaped, $pid is no longer stream_close()'s to signal. */
+	pthread_mutex_lock(&s->lock);
+	s->eof = true;
+	pid = s->pid;
+	s->pid = -1;
+	pthread_cond_broadcast(&s->grown);
+	pthread_mutex_unlock(&s->lock);
+
+	stop_input(s->fd, pid);
+	pthread_mutex_lock(&s->lock);
+	s->done = true;
+	closed = s->closed;
+	pthread_mutex_unlock(&s->lock);
+	if(closed) free_stream(s);
+	return NULL;
+}
+
+/* Start reading from $fd, output by the executable $pid if it's not -1,
+ * on a reader thread. $fd and $pid belong to the stream even on failure. */
+static Stream* stream_start(int fd, pid_t pid, bool is_quotes, size_t max) {
+	Stream* const s = ecalloc(1, sizeof(Stream));
+	pthread_t thread;
+
+	s->fd = fd;
+	s->pid = pid;
+	s->is_quotes = is_quotes;
+	s->max = max;
+	s->hash = FNV_OFFSET;
+	s->spool = -1;
+	s->wake[0] = s->wake[1] = -1;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->grown, NULL);
+	if(fd < 0 || pipe(s->wake) < 0) {
+		stop_input(fd, pid);
+		free_stream(s);
+		return NULL;
+	}
+
+	/* keep executables started later from inheriting them. */
+	fcntl(s->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(s->wake[1], F_SETFD, FD_CLOEXEC);
+	if(is_quotes) {
+		FILE* const tmp = tmpfile();
+
+		if(tmp) {
+			s->spool = fcntl(fileno(tmp), F_DUPFD_CLOEXEC, 0);
+			fclose(tmp);
+		}
+	}
+
+	if((is_quotes && s->spool < 0)
+	|| pthread_create(&thread, NULL, run_reader, s) != 0) {
+		stop_input(fd, pid);
+		free_stream(s);
+		return NULL;
+	}
+
+	pthread_detach(thread);
+	return s;
+}
+
+/* Start reading a dictionary from $fd in the background, returning once
+ * $min words have been read or $fd reaches EOF. No more than $max words
+ * are read, unless $max is 0. */
+Stream* stream_dict_start(int fd, pid_t pid, size_t min, size_t max) {
+	Stream* const s = stream_start(fd, pid, false, max);
+
+	if(!s) return NULL;
+	pthread_mutex_lock(&s->lock);
+	while(s->sz < min && !s->eof)
+		pthread_cond_wait(&s->grown, &s->lock);
+
+	pthread_mutex_unlock(&s->lock);
+	return s;
+}
+
+/* Start reading a quotes-file from $fd in the background; no more than
+ * $max bytes of quotes are read, unless $max is 0. */
+Stream* stream_quotes_start(int fd, pid_t pid, size_t max) {
+	return stream_start(fd, pid, true, max);
+}
+
+/* Stop reading $s and the executable writing to it, and free $s once
+ * its reader is done; this doesn't wait on either. What was taken from
+ * it must be freed first. */
+void stream_close(Stream* s) {
+	bool done;
+
+	pthread_mutex_lock(&s->lock);
+	s->closed = true;
+	if(s->pid > 0) kill(-s->pid, SIGTERM);
+	/* written while locked, so the reader can't free $s first. */
+	if(!(done = s->done))
+		while(write(s->wake[1], "", 1) < 0 && errno == EINTR);
+
+	pthread_mutex_unlock(&s->lock);
+	if(done) free_stream(s);
+}
+
+/* If words were read since the last call, merge them into $dict and
+ * return true. $dict must be zeroed before the first call and only be
+ * changed by these calls. It owns its $words and $counts but not the
+ * strings, which live until $s is closed. Its hash is of the words
+ * in the order they were read. */
+bool stream_dict_update(Stream* s, Dictionary* dict) {
+	size_t count[MAX_WORD+1] = {0};
+	size_t pos[MAX_WORD+1];
+	const size_t old = dict->sz;
+	size_t sz, add, shift;
+	Word* tail;
+	uint32_t* tail_counts;
+	uint64_t hash;
+	bool weighted;
+
+	pthread_mutex_lock(&s->lock);
+	if(s->sz == s->taken) {
+		pthread_mutex_unlock(&s->lock);
+		return false;
+	}
+
+	/* the reader may move $s->words as soon as it's unlocked. */
+	add = s->sz - s->taken;
+	tail = ecalloc(add, sizeof(Word));
+	tail_counts = ecalloc(add, sizeof(uint32_t));
+	memcpy(tail, &s->words[s->taken], add * sizeof(Word));
+	memcpy(tail_counts, &s->counts[s->taken], add * sizeof(uint32_t));
+	s->taken = s->sz;
+	weighted = s->weighted;
+	hash = s->hash;
+	pthread_mutex_unlock(&s->lock);
+
+	sz = old + add;
+	dict->words = ereallocarray(dict->words, sz, sizeof(Word));
+	if(weighted) {
+		const bool was = dict->counts != NULL;
+
+		/* words read before the first count each count once. */
+		dict->counts = ereallocarray(dict->counts, sz, sizeof(uint32_t));
+		for(size_t i=0; !was && i<old; i++)
+			dict->counts[i] = 1;
+	}
+
+	for(size_t i=0; i<add; i++)
+		count[tail[i].len]++;
+
+	/* move each length's words up past the new words of shorter lengths,
+	 * longest first, leaving room at the end of each for its own. */
+	shift = add;
+	for(int n=MAX_WORD; n>=0; n--) {
+		const size_t start = dict->len_idx[n];
+		const size_t len = dict->len_idx[n+1] - start;
+
+		shift -= count[n];
+		if(shift && len) {
+			memmove(&dict->words[start+shift], &dict->words[start], len * sizeof(Word));
+			if(dict->counts)
+				memmove(&dict->counts[start+shift], &dict->counts[start], len * sizeof(uint32_t));
+		}
+
+		pos[n] = start + shift + len;
+	}
+
+	for(int n=0; n<=MAX_WORD; n++)
+		dict->len_idx[n+1] = pos[n] + count[n];
+
+	for(size_t i=0; i<add; i++) {
+		const size_t j = pos[tail[i].len]++;
+
+		dict->words[j] = tail[i];
+		if(dict->counts) dict->counts[j] = tail_counts[i];
+	}
+
+	free(tail);
+	free(tail_counts);
+	dict->sz = sz;
+	dict->hash = hash;
+	return true;
+}
+
+/* If quotes were read since the last call, append them to $quotes,
+ * whose map is replaced by one of every quote read so far, and return
+ * true. $quotes must be zeroed before the first call and only be
+ * changed by these calls; it can be freed with free_quotes(). */
+bool stream_quotes_update(Stream* s, Quotes* quotes) {
+	size_t add, sz_map;
+	Quote* tail;
+	void* map;
+
+	pthread_mutex_lock(&s->lock);
+	if(s->sz == s->taken) {
+		pthread_mutex_unlock(&s->lock);
+		return false;
+	}
+
+	add = s->sz - s->taken;
+	tail = ecalloc(add, sizeof(Quote));
+	memcpy(tail, &s->quotes[s->taken], add * sizeof(Quote));
+	sz_map = s->sz_spool;
+	pthread_mutex_unlock(&s->lock);
+
+	/* the quotes stay the stream's until they can be used. */
+	if((map = mmap(NULL, sz_map, PROT_READ, MAP_PRIVATE, s->spool, 0)) == MAP_FAILED) {
+		free(tail);
+		return false;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->taken += add;
+	pthread_mutex_unlock(&s->lock);
+
+	quotes->quotes = ereallocarray(quotes->quotes, quotes->sz + add, sizeof(Quote));
+	memcpy(&quotes->quotes[quotes->sz], tail, add * sizeof(Quote));
+	quotes->sz += add;
+	unmap_file(quotes->map, quotes->sz_map);
+	quotes->map = map;
+	quotes->sz_map = sz_map;
+	free(tail);
+	return true;
+}
@@ -0,0 +1,15 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "def.h"
+
+Stream* stream_dict_start(int, pid_t, size_t, size_t);
+bool stream_dict_update(Stream*, Dictionary*);
+Stream* stream_quotes_start(int, pid_t, size_t);
+bool stream_quotes_update(Stream*, Quotes*);
+void stream_close(Stream*);
+
+#endif /* STREAM_H */
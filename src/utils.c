@@ -5,6 +5,11 @@
 #include <string.h>
 #include <stdarg.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <dirent.h>
 #include <time.h>
 #include <ctype.h>
@@ -26,6 +31,70 @@ void* ecalloc(size_t nmemb, size_t sz) {
     return ptr;
 }
 
+/* Allocate $nmemb zero'd elements of size $sz from $arena. Blocks are
+ * only ever added, so previously returned pointers stay valid until
+ * arena_reset(). */
+void* arena_alloc(Arena* arena, size_t nmemb, size_t sz) {
+	const size_t align = sizeof(max_align_t);
+	ArenaBlock* blk = arena->head;
+	size_t n;
+	void* ptr;
+
+	if(sz && nmemb > (SIZE_MAX - align) / sz) {
+		fprintf(stderr, "Error: Memory exhausted");
+		exit(1);
+	}
+
+	n = (nmemb*sz + align-1) & ~(align-1);
+	if(!blk || blk->sz - blk->used < n) {
+		size_t bsz = (blk) ? blk->sz*2 : ARENA_BLOCK_SIZE;
+		if(bsz < n) bsz = n;
+
+		blk = ecalloc(1, sizeof(ArenaBlock) + bsz);
+		blk->prev = arena->head;
+		blk->sz = bsz;
+		arena->head = blk;
+	}
+
+	ptr = (char*)blk->data + blk->used;
+	blk->used += n;
+	return memset(ptr, 0, n);
+}
+
+/* Release everything allocated from $arena. If it had outgrown its
+ * first block the blocks are merged into one, so a test of the same
+ * size won't need to allocate again. */
+void arena_reset(Arena* arena) {
+	ArenaBlock* blk = arena->head;
+	size_t total = 0;
+
+	if(!blk) return;
+	if(!blk->prev) {
+		blk->used = 0;
+		return;
+	}
+
+	while(blk) {
+		ArenaBlock* prev = blk->prev;
+		total += blk->sz;
+		free(blk);
+		blk = prev;
+	}
+
+	arena->head = ecalloc(1, sizeof(ArenaBlock) + total);
+	arena->head->sz = total;
+}
+
+/* Release $arena's blocks. */
+void arena_free(Arena* arena) {
+	while(arena->head) {
+		ArenaBlock* const prev = arena->head->prev;
+
+		free(arena->head);
+		arena->head = prev;
+	}
+}
+
 void* ereallocarray(void* ptr, size_t nmemb, size_t sz) {
     void* nptr;
 
@@ -37,6 +106,18 @@ void* ereallocarray(void* ptr, size_t nmemb, size_t sz) {
     return nptr;
 }
 
+/* 64-bit FNV-1a of $sz bytes at $buf, continuing from $hash (FNV_OFFSET to start). */
+uint64_t fnv1a(const void* buf, size_t sz, uint64_t hash) {
+	const unsigned char* p = buf;
+
+	for(size_t i=0; i<sz; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
 int streqi(const char* str1, const char* str2) {
 	size_t i=0;
 
@@ -49,27 +130,6 @@ int streqi(const char* str1, const char* str2) {
 	return 1;
 }
 
-/* Assumes $buf's capacity is at least: $strlen(buf) + $strlen(str) + 1 */
-int encase_word(char* buf, const char* str) {
-	const int blen = strlen(buf);
-	const int slen = strlen(str);
-
-	if(!slen || slen & 1) return -1;
-
-	int dist = strlen(str) / 2;
-	for(int i = blen+dist; i-dist >= 0; i--)
-		buf[i] = buf[i-dist];
-
-	for(int i=0; i<dist; i++)
-		buf[i] = str[i];
-
-	for(int i=0; i<dist; i++)
-		buf[i+blen+dist] = str[i+dist];
-
-	buf[blen+slen] = '\0';
-	return 0;
-}
-
 static int hextoint(int ch) {
     static char* hex = "abcdefABCDEF";
 
@@ -285,6 +345,26 @@ void free_words(Word* chpp, size_t sz) {
 	chpp = NULL;
 }
 
+void free_hist(History* hist) {
+	free(hist->stats);
+	free(hist->text);
+	free(hist->matches);
+	free(hist->strs);
+}
+
+void free_dict(Dictionary* dict) {
+	free(dict->words);
+	free(dict->counts);
+	if(dict->map) munmap(dict->map, dict->sz_map);
+	else free(dict->blob);
+
+	dict->words = NULL;
+	dict->counts = NULL;
+	dict->blob = NULL;
+	dict->map = NULL;
+	dict->sz = 0;
+}
+
 void free_strs(char** strs, size_t sz) {
 	for(size_t i=0; i<sz; i++)
 		free(strs[i]);
@@ -300,12 +380,17 @@ void free_namevals(NameVal* lv, size_t sz) {
 void free_quote(Quote* quote) {
 	free(quote->author);
 	free(quote->source);
-	free_words(quote->text, quote->sz);
 }
 
 void free_quotes(Quotes* quote) {
 	for(size_t i=0; i<quote->sz; i++)
 		free_quote(&quote->quotes[i]);
+
+	free(quote->quotes);
+	unmap_file(quote->map, quote->sz_map);
+	quote->quotes = NULL;
+	quote->map = NULL;
+	quote->sz = 0;
 }
 
 int find_str(char** strstr, const char* str) {
@@ -344,10 +429,11 @@ size_t strstr_len(char** strstr) {
 
 char** strstr_dup(char** strstr) {
 	size_t len = strstr_len(strstr);
-	char** ret = malloc(len+1 * sizeof(char**));
+	char** ret = malloc((len+1) * sizeof(char*));
 	if(ret == NULL)
 		return NULL;
 
+	ret[len] = NULL;
 	for(size_t i=0; i<len; i++) {
 		if((ret[i] = strdup(strstr[i])) == NULL) {
 			free_strs(ret, i);
@@ -432,19 +518,158 @@ int snprintf_fit(char* buf, size_t sz, int width, const char* fmt, ...) {
 FILE* path_fopen(char** path, const char* fname) {
 	size_t bsz = 4096;
 	char buf[bsz];
-	FILE* file;
+
+	if(path_find(path, fname, buf, bsz) < 0)
+		return NULL;
+
+	return fopen(buf, "r");
+}
+
+/* Store the path of the first $fname in the directories $path in $buf.
+ * Return -1 if there is none. */
+int path_find(char** path, const char* fname, char* buf, size_t sz) {
+	struct stat st;
+
 	for(size_t i=0; path[i]; i++) {
-		snprintf(buf, bsz, "%s/%s", path[i], fname); 
+		if(snprintf(buf, sz, "%s/%s", path[i], fname) >= (int)sz)
+			continue;
 
-		if((file = fopen(buf, "r")) == NULL) {
-			if(errno == ENOENT) continue;
-			break;
+		if(stat(buf, &st) == 0) return 0;
+		if(errno != ENOENT) break;
+	}
+
+	return -1;
+}
+
+/* Run the executable $file with the environment $env, stdin and stderr
+ * redirected to /dev/null, in a process group of its own, and return
+ * the read end of a pipe from its stdout; $*pid is set to its process id.
+ * Return -1 with errno set if it couldn't be run. */
+int exec_spawn(const char* file, char* const* env, pid_t* pid) {
+	char* const argv[] = { (char*)file, NULL };
+	int fds[2], errfds[2];
+	int err = 0;
+	ssize_t n;
+
+	if(pipe(fds) < 0) return -1;
+	if(pipe(errfds) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	/* keep processes started by other threads from holding the pipes open;
+	 * $errfds is closed by a successful exec. */
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(errfds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(errfds[1], F_SETFD, FD_CLOEXEC);
+	if((*pid = fork()) < 0) {
+		err = errno;
+		close(fds[0]);
+		close(fds[1]);
+		close(errfds[0]);
+		close(errfds[1]);
+		errno = err;
+		return -1;
+	}
+
+	/* only async-signal-safe calls until exec. */
+	if(*pid == 0) {
+		const int null = open("/dev/null", O_RDWR);
+
+		setpgid(0, 0);
+		if(null < 0 || dup2(null, STDIN_FILENO) < 0 || dup2(null, STDERR_FILENO) < 0
+		|| dup2(fds[1], STDOUT_FILENO) < 0)
+			err = errno;
+		else {
+			execve(file, argv, env);
+			err = errno;
 		}
 
-		else return file;
+		while(write(errfds[1], &err, sizeof(err)) < 0 && errno == EINTR);
+		_exit(127);
 	}
 
-	return NULL;
+	/* set here too, so it's in place before the group is signalled. */
+	setpgid(*pid, *pid);
+	close(fds[1]);
+	close(errfds[1]);
+	while((n = read(errfds[0], &err, sizeof(err))) < 0 && errno == EINTR);
+	close(errfds[0]);
+	if(n > 0) {
+		close(fds[0]);
+		while(waitpid(*pid, NULL, 0) < 0 && errno == EINTR);
+		errno = err;
+		return -1;
+	}
+
+	return fds[0];
+}
+
+/* Map the entire contents of $fd into memory, read-only. Streams that can't
+ * be mapped (such as pipes) are first copied into a temporary file.
+ * An empty file sets $buf to NULL & $sz to 0. */
+int map_file(FILE* fd, char** buf, size_t* sz) {
+	const size_t bsz = 8192;
+	char chunk[bsz];
+	struct stat st;
+	FILE* spool = NULL;
+	void* map;
+	int fdn = fileno(fd);
+
+	if(fstat(fdn, &st) < 0) return -1;
+
+	if(!S_ISREG(st.st_mode)) {
+		size_t n;
+
+		if(!(spool = tmpfile())) return -1;
+		while((n = fread(chunk, 1, bsz, fd)) > 0) {
+			if(fwrite(chunk, 1, n, spool) != n) {
+				fclose(spool);
+				return -1;
+			}
+		}
+
+		if(ferror(fd) || fflush(spool) == EOF
+		|| fstat(fdn = fileno(spool), &st) < 0) {
+			fclose(spool);
+			return -1;
+		}
+	}
+
+	*buf = NULL;
+	*sz = st.st_size;
+	if(*sz) {
+		if((map = mmap(NULL, *sz, PROT_READ, MAP_PRIVATE, fdn, 0)) == MAP_FAILED) {
+			if(spool) fclose(spool);
+			return -1;
+		}
+
+		posix_madvise(map, *sz, POSIX_MADV_SEQUENTIAL);
+		*buf = map;
+	}
+
+	/* the mapping remains valid after the spool is closed. */
+	if(spool) fclose(spool);
+	return 0;
+}
+
+/* append the whole of $src to $dst. */
+int fcopy(FILE* dst, FILE* src) {
+	char buf[BUFSIZ];
+	size_t n;
+
+	rewind(src);
+	while((n = fread(buf, 1, sizeof(buf), src)) > 0)
+		if(fwrite(buf, 1, n, dst) != n)
+			return -1;
+
+	return ferror(src) ? -1 : 0;
+}
+
+void unmap_file(char* buf, size_t sz) {
+	if(buf) munmap(buf, sz);
 }
 
 /* Given path to a directory, return the contents of said directory. */
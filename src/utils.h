@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include <string.h>
 
 #include "def.h"
@@ -21,6 +22,7 @@
 #define walignstr_bottom(win, str, dist) (walign_bottom(win, strlen(str), dist))
 
 #define arr_size(x) (sizeof(x)/sizeof(*x))
+#define FNV_OFFSET 0xcbf29ce484222325ULL
 static inline bool streq(const char* str1, const char* str2) {
 	return strcmp(str1, str2) == 0;
 }
@@ -47,10 +49,13 @@ static inline bool is_range_off(const ConfRange* r) {
 
 void* ecalloc(size_t, size_t);
 void* ereallocarray(void*, size_t, size_t);
+void* arena_alloc(Arena*, size_t, size_t);
+void arena_reset(Arena*);
+void arena_free(Arena*);
 
 int streqi(const char*, const char*);
+uint64_t fnv1a(const void*, size_t, uint64_t);
 
-int encase_word(char*, const char*);
 
 int to_rgb(const char*, RGB*);
 void rgb_to_cursrgb(RGB*);
@@ -72,6 +77,8 @@ int skipws(const char*, const char*);
 int get_delims(FILE*, char*, size_t, const char*);
 
 void free_words(Word*, size_t);
+void free_dict(Dictionary*);
+void free_hist(History*);
 void free_strs(char**, size_t);
 void free_namevals(NameVal*, size_t);
 void free_quote(Quote* quote);
@@ -92,6 +99,11 @@ int vsnprintf_fit(char*, size_t, int, const char*, va_list);
 int snprintf_fit(char*, size_t, int, const char*, ...);
 
 FILE* path_fopen(char**, const char*);
+int path_find(char**, const char*, char*, size_t);
+int exec_spawn(const char*, char* const*, pid_t*);
+int map_file(FILE*, char**, size_t*);
+void unmap_file(char*, size_t);
+int fcopy(FILE*, FILE*);
 
 int dir_contents(char*, char***);
 int dirs_contents(char**, char***, int);
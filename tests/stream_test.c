@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "def.h"
+#include "utils.h"
+#include "loaders.h"
+#include "stream.h"
+
+/* Tests of stream.c, reading from this program re-run as a stub
+ * executable; $STUB_ENV names what the stub outputs. */
+
+#define STUB_ENV "STREAM_TEST_STUB"
+
+#define check(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while(0)
+
+static int failures = 0;
+static const char* self;
+
+static void nap(long ms) {
+	struct timespec ts = {.tv_sec = ms/1000, .tv_nsec = (ms%1000) * 1000000};
+
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/* Output what $mode names, then linger until signalled. */
+static int run_stub(const char* mode) {
+	if(streq(mode, "dict")) {
+		fputs("alpha beta\ngamma\t5\ndelt", stdout);
+	} else if(streq(mode, "dict-eof")) {
+		fputs("alpha\nbeta", stdout);
+		return 0;
+	} else if(streq(mode, "quotes")) {
+		fputs("author: A\n{ one \\} two }\n{ }\nauthor: B\n{ three }\n{ par", stdout);
+	} else if(streq(mode, "flood")) {
+		while(fputs("w\n", stdout) >= 0);
+		return 0;
+	}
+
+	fflush(stdout);
+	while(true) pause();
+}
+
+static int spawn_stub(const char* mode, pid_t* pid) {
+	char var[64];
+	char* env[] = {var, NULL};
+
+	snprintf(var, sizeof(var), "%s=%s", STUB_ENV, mode);
+	return exec_spawn(self, env, pid);
+}
+
+/* Whether $pid was stopped & reaped within a few seconds. */
+static bool reaped(pid_t pid) {
+	for(int i=0; i<500; i++) {
+		if(kill(pid, 0) < 0 && errno == ESRCH) return true;
+		nap(10);
+	}
+
+	return false;
+}
+
+static void test_dict(void) {
+	Dictionary dict = {.words = NULL, .sz = 0};
+	pid_t pid;
+	int fd = spawn_stub("dict", &pid);
+	Stream* s;
+
+	check(fd >= 0);
+	check((s = stream_dict_start(fd, pid, 3, 0)) != NULL);
+	if(!s) return;
+
+	/* the unterminated "delt" waits on the rest of its line. */
+	check(stream_dict_update(s, &dict));
+	nap(100);
+	check(!stream_dict_update(s, &dict));
+	check(dict.sz == 3);
+	check(dict.len_idx[5] == 1 && dict.len_idx[6] == 3);
+	check(dict.counts && dict.counts[2] == 5 && streq(dict.words[2].str, "gamma"));
+	free_dict(&dict);
+	stream_close(s);
+	check(reaped(pid));
+}
+
+static void test_dict_eof(void) {
+	Dictionary dict = {.words = NULL, .sz = 0};
+	pid_t pid;
+	int fd = spawn_stub("dict-eof", &pid);
+	Stream* s;
+
+	check((s = stream_dict_start(fd, pid, 2, 0)) != NULL);
+	if(!s) return;
+
+	/* the last line needn't end in a newline. */
+	check(stream_dict_update(s, &dict));
+	check(dict.sz == 2);
+	check(!dict.counts);
+	free_dict(&dict);
+	stream_close(s);
+}
+
+static void test_quotes(void) {
+	Quotes quotes = {.quotes = NULL, .sz = 0};
+	pid_t pid;
+	int fd = spawn_stub("quotes", &pid);
+	Stream* s;
+	Word* text;
+	char* blob;
+
+	check((s = stream_quotes_start(fd, pid, 0)) != NULL);
+	if(!s) return;
+
+	for(int i=0; i<500 && quotes.sz < 2; i++) {
+		stream_quotes_update(s, &quotes);
+		nap(10);
+	}
+
+	/* the empty quote is dropped, the partial one held back. */
+	nap(100);
+	check(!stream_quotes_update(s, &quotes));
+	check(quotes.sz == 2);
+	if(quotes.sz == 2) {
+		check(streq(quotes.quotes[0].author, "A"));
+		check(streq(quotes.quotes[1].author, "B"));
+		check(load_quote_text(&quotes, &quotes.quotes[0], &text, &blob) == 0);
+		check(quotes.quotes[0].sz == 3 && streq(text[1].str, "}"));
+		free(text);
+		free(blob);
+		check(load_quote_text(&quotes, &quotes.quotes[1], &text, &blob) == 0);
+		check(quotes.quotes[1].sz == 1 && streq(text[0].str, "three"));
+		free(text);
+		free(blob);
+	}
+
+	free_quotes(&quotes);
+	stream_close(s);
+	check(reaped(pid));
+}
+
+static void test_flood(void) {
+	Dictionary dict = {.words = NULL, .sz = 0};
+	pid_t pid;
+	int fd = spawn_stub("flood", &pid);
+	Stream* s;
+
+	check((s = stream_dict_start(fd, pid, 1000, 1000)) != NULL);
+	if(!s) return;
+
+	/* the executable is stopped once $max words are read. */
+	check(reaped(pid));
+	stream_dict_update(s, &dict);
+	check(dict.sz == 1000);
+	free_dict(&dict);
+	stream_close(s);
+}
+
+static void test_noexec(void) {
+	char path[] = "/tmp/stream_test.XXXXXX";
+	char* env[] = {NULL};
+	pid_t pid;
+	int fd;
+
+	/* text marked executable, as on filesystems without modes. */
+	check((fd = mkstemp(path)) >= 0);
+	if(fd < 0) return;
+	check(write(fd, "hello\n", 6) == 6);
+	fchmod(fd, 0777);
+	close(fd);
+	check(exec_spawn(path, env, &pid) < 0 && errno == ENOEXEC);
+	unlink(path);
+}
+
+int main(int argc, char** argv) {
+	const char* const mode = getenv(STUB_ENV);
+
+	if(mode) return run_stub(mode);
+	self = argv[0];
+	test_dict();
+	test_dict_eof();
+	test_quotes();
+	test_flood();
+	test_noexec();
+	return (failures) ? 1 : 0;
+}